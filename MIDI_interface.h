@@ -27,18 +27,35 @@
 #endif
 
 #define _POSIX_C_SOURCE 200809L
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // thread affinity, define it yourself if including after other system headers
+#endif
 
 #include <math.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIDI_X86_DISPATCH // SIMD step engines built with target attributes and picked at runtime, no -m flags needed
 #include <immintrin.h>
+#define MIDI_CPU_RELAX() _mm_pause()
+#else
+#define MIDI_CPU_RELAX()
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sched.h>
 
 #define MIDI_COMMAND_TYPE_BYTE_MASK 0xF0
 typedef enum
@@ -95,51 +112,285 @@ typedef struct
     uint8_t param2;
 } MIDI_Command;
 
-
-typedef struct Channel_Node Channel_Node;
-typedef struct Channel_Node
+/* Command with the time it entered the interface, for placing it sample accurately inside an audio block */
+typedef struct
 {
-    const MIDI_Command command;
+    MIDI_Command command;
     /* 1-byte hole */
-    const uint16_t on_tick;
-    /* 2-byte hole */
-    Channel_Node* next;
-} Channel_Node;
+    uint32_t tick;          // clock tick count the command was produced on
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC nanoseconds, see midi_time_now_ns
+} MIDI_Event;
+
+typedef enum
+{
+    MIDI_CONSUMER_BLOCKING   = 0, // the producer never overwrites events this consumer hasn't read, new events are dropped instead
+    MIDI_CONSUMER_SKIP_AHEAD = 1  // the producer doesn't wait for this consumer, when lapped it jumps to the oldest event still held
+} MIDI_Consumer_Policy;
+
+/* Read cursor of one registered consumer, each on its own cache line */
+typedef struct
+{
+    _Alignas(64) _Atomic uint32_t cursor; // next event to read
+    _Atomic uint32_t skipped;             // events lost by a skip ahead consumer that fell more than a ring behind
+    _Atomic uint8_t active;
+    uint8_t policy;
+    uint32_t last_tick;                   // clock tick count at the consumer's last midi_consumer_ticks, only touched by the consumer
+} MIDI_Consumer;
+
+/* What the producer does when a blocking consumer is a full ring behind */
+typedef enum
+{
+    MIDI_OVERFLOW_DROP_NEWEST     = 0, // the new event is discarded and counted
+    MIDI_OVERFLOW_REJECT          = 1, // the new event is discarded and the send call returns MIDI_QUEUE_FULL so the caller can retry
+    MIDI_OVERFLOW_DROP_OLDEST     = 2  // the oldest event is overwritten, lagging consumers jump ahead like skip ahead consumers
+} MIDI_Overflow_Policy;
+
+/* Snapshot of the queue counters, see midi_queue_stats */
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t high_water;        // most events ever waiting on the slowest blocking consumer
+    uint64_t dropped;           // discarded by MIDI_OVERFLOW_DROP_NEWEST
+    uint64_t rejected;          // refused by MIDI_OVERFLOW_REJECT
+    uint64_t overwritten;       // unread events replaced by MIDI_OVERFLOW_DROP_OLDEST
+} MIDI_Queue_Stats;
+
+#define MIDI_QUEUE_FULL -2
+
+/* Wait-free broadcast ring of events. Producers are serialised on the controller mutex, every registered consumer
+ * reads at its own cursor without taking a lock. Slots are reused once all blocking consumers have passed them */
+#define MIDI_COMMAND_DEFAULT_CAPACITY 256
+#define MIDI_MAX_CONSUMERS 8
+#define MIDI_DEFAULT_CONSUMER 0 // registered at setup, read by midi_commands_poll and midi_events_poll
+typedef struct
+{
+    MIDI_Event* buffer;
+    uint32_t mask; // capacity -1, capacity is always a power of two
+    uint8_t overflow_policy;
+    _Alignas(64) _Atomic uint32_t head; // next slot to write, only moved by the producer
+    _Atomic uint32_t high_water;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t overwritten;
+    MIDI_Consumer consumers[MIDI_MAX_CONSUMERS];
+} MIDI_Command_Queue;
+
+/* Sequenced output rendered ahead of its deadline when lookahead is on. The producer is serialised on the controller mutex,
+ * the sender thread is the only consumer and writes each command extern at its deadline */
+#define MIDI_OUTBOUND_CAPACITY 4096 // power of two
+#define MIDI_DEFAULT_SPIN_NS 200000 // the sender sleeps until this close to a deadline and spins the rest
+typedef struct
+{
+    uint64_t deadline_ns;
+    MIDI_Command command;
+} MIDI_Outbound_Event;
 
-#define MIDI_TICKS_PER_QUATER_NOTE 24
+typedef struct
+{
+    MIDI_Outbound_Event* buffer;
+    uint32_t mask;
+    uint8_t sender_waiting; // sender is blocked on an empty queue, only touched with the controller mutex held
+    _Alignas(64) _Atomic uint32_t head; // next slot to write
+    _Alignas(64) _Atomic uint32_t tail; // next slot the sender writes out
+} MIDI_Outbound_Queue;
+
+#define MIDI_TICKS_PER_QUATER_NOTE 24 // midi clock ticks on the wire, the sequencer runs at its own ppqn
 #define MIDI_TICKS_PER_BAR MIDI_TICKS_PER_QUATER_NOTE * 4 //as one quater note translates to "one beat" in 4x4 music
+#define MIDI_DEFAULT_PPQN MIDI_TICKS_PER_QUATER_NOTE
 #define MIDI_MAX_CHANNELS 16
 
+#define MIDI_TRACK_LANES 16 // the step engine walks the tracks in blocks of this many, one AVX-512 or two AVX2 registers
+
+/* Every track compiled into one block, struct of arrays so launching and stepping walk memory in order.
+ * Each block in the file is a track with its own loop, several tracks can play on the same channel.
+ * A track's events are [first, wrap) in launch order, position moves back to first when it reaches wrap.
+ * The per track arrays are lane_count long, the padding lanes after track_count never launch */
+typedef struct
+{
+    uint32_t* ticks;          // on_tick of each event, in sequencer steps
+    MIDI_Command* commands;   // same index as ticks, packed 3 bytes
+    uint32_t event_count;
+    uint32_t track_count;
+    uint32_t lane_count;      // track_count rounded up to MIDI_TRACK_LANES
+    uint32_t* loop_steps;     // last step of the track's loop
+    uint32_t* current_step;
+    uint32_t* next_command;   // step of the next event, UINT32_MAX on padding lanes
+    uint32_t* first;
+    uint32_t* wrap;
+    uint32_t* position;       // next event to launch
+    uint8_t* channel;         // channel the track was written for, 0 - 15
+    /* MIDI_SCHEDULER_HEAP state, tracks ordered by the absolute step their next event is due */
+    uint64_t step;            // next step to run, counted from setup
+    uint64_t* due;
+    uint64_t* loop_start;     // absolute step the track's current loop began
+    uint32_t* heap;           // track indices, a min-heap on (due, track)
+    uint32_t heap_size;
+    uint32_t bar_steps;       // steps in a bar of the first track's time signature, midi_pattern_load swaps on these
+    void* mapping;            // pattern image the block is mapped from, NULL when allocated
+    size_t mapping_size;
+} MIDI_Pattern;
+
+/* Compiled pattern saved as is, see midi_pattern_image_write. The block follows the header in the layout
+ * midi_pattern_alloc gives it, so the file is mapped and played with no parsing. Native byte order */
+#define MIDI_PATTERN_IMAGE_MAGIC "MIDIPAT"
+#define MIDI_PATTERN_IMAGE_VERSION 1
+#define MIDI_PATTERN_IMAGE_BYTE_ORDER 0x01020304
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;      // MIDI_PATTERN_IMAGE_BYTE_ORDER as written, reads differently on the other endianness
+    uint32_t header_size;     // the block starts here
+    uint32_t ppqn;            // steps are at this resolution, the controller has to match
+    uint32_t track_count;
+    uint32_t event_count;
+    uint32_t heap_size;
+    uint16_t active_channels;
+    /* 2-byte hole */
+    uint64_t block_size;
+    uint32_t bar_steps;       // 0 in older images, read as a 4/4 bar
+    uint8_t reserved[12];
+} MIDI_Pattern_Image_Header;
+
+#define MIDI_DEFAULT_BURST_LIMIT 128
+
+/* Instruction set the step engine runs on, picked once at setup from cpuid */
+typedef enum
+{
+    MIDI_STEP_ENGINE_AUTO   = 0, // best the CPU supports
+    MIDI_STEP_ENGINE_SCALAR = 1,
+    MIDI_STEP_ENGINE_SSE2   = 2,
+    MIDI_STEP_ENGINE_AVX2   = 3,
+    MIDI_STEP_ENGINE_AVX512 = 4
+} MIDI_Step_Engine_ISA;
+
+/* How the tracks are stepped, scanning is cheapest for dense patterns, the heap for sparse ones at high ppqn */
+typedef enum
+{
+    MIDI_SCHEDULER_SCAN = 0, // every track is compared and stepped on every step, with the SIMD step engine
+    MIDI_SCHEDULER_HEAP = 1  // only tracks with an event due are touched, steps with nothing due are O(1)
+} MIDI_Step_Scheduler;
+
+struct MIDI_Controller;
 typedef struct
 {
-    uint16_t node_count[MIDI_MAX_CHANNELS];
-    uint16_t loop_steps[MIDI_MAX_CHANNELS];
-    uint16_t current_step[MIDI_MAX_CHANNELS];
-    uint16_t next_command[MIDI_MAX_CHANNELS];
-    Channel_Node* channel[MIDI_MAX_CHANNELS];
+    uint32_t burst_limit;     // most events a track launches on one tick, the rest spill onto the following ticks
+    uint32_t ppqn;            // sequencer steps per quater note
+    uint32_t steps_per_clock; // ppqn / 24, steps per midi clock tick
+    MIDI_Step_Engine_ISA step_engine_isa;
+    void (*step_tracks)(struct MIDI_Controller* controller); // one step of every track, set by midi_step_engine_select
+    MIDI_Pattern pattern;
+    /* midi_pattern_load hand over, the step engine is wrapped only while a swap is pending so ticks pay nothing otherwise */
+    void (*swap_step_tracks)(struct MIDI_Controller* controller); // engine to put back once swapped
+    uint64_t swap_countdown;  // steps left until the boundary
+    uint64_t pattern_start;   // step the playing pattern came in on, its bars are counted from here
+    uint64_t next_pattern_start;
+    MIDI_Pattern next_pattern;
+    MIDI_Pattern retired_pattern; // nothing reads it once swapped out, freed by the next load or destroy
+    uint16_t next_active_channels;
 } Input_Controller;
 
-#define MIDI_COMMAND_MAX_COUNT 50
+/* Scheduling for the interface threads, zero values leave the thread as created */
+typedef struct
+{
+    int policy;            // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;          // 1-99 for SCHED_FIFO and SCHED_RR
+    uint64_t cpu_mask;     // one bit per cpu the thread may run on, 0 for any
+    uint8_t lock_memory;   // mlockall the whole process so page faults can't stall the thread
+} MIDI_Thread_Config;
+
+#define MIDI_THREAD_APPLIED_POLICY   (1<<0)
+#define MIDI_THREAD_APPLIED_AFFINITY (1<<1)
+#define MIDI_THREAD_APPLIED_MEMLOCK  (1<<2)
+/* What was actually applied, settings that failed (normally missing permissions) fall back to the defaults */
+typedef struct
+{
+    uint8_t requested;     // MIDI_THREAD_APPLIED_* flags asked for
+    uint8_t applied;       // MIDI_THREAD_APPLIED_* flags that succeeded
+    int policy;            // policy and priority the thread ended up with
+    int priority;
+    uint64_t cpu_mask;     // cpus the thread ended up allowed on (first 64)
+    int error;             // errno of the last failure, 0 if everything applied
+} MIDI_Thread_Report;
+
 #define MIDI_CLOCK_COMMAND_SENT     (1<<0)
 #define MIDI_EXTERNAL_CONNECTION    (1<<1)
 #define MIDI_CLOCK_ENABLED          (1<<2)
 #define MIDI_EXTERNAL_INPUT         (1<<3)
 #define MIDI_EXTERNAL_THROUGH       (1<<4)
+#define MIDI_THREAD_RUNNING         (1<<5)
 #define MIDI_CLOCK_DESTROY          (1<<6)
 #define MIDI_INTERFACE_DESTORY      (1<<7)
+#define MIDI_TICK_INLINE            (1<<8)
+#define MIDI_LOOKAHEAD              (1<<9)
+#define MIDI_SENDER_RUNNING         (1<<10)
+
+/* How the tempo gets from the previous tempo map point to this one */
+typedef enum
+{
+    MIDI_TEMPO_JUMP        = 0, // holds the previous tempo and changes on the point
+    MIDI_TEMPO_LINEAR      = 1, // bpm moves in a straight line
+    MIDI_TEMPO_EXPONENTIAL = 2  // bpm moves by the same ratio every beat, sounds even over wide ranges
+} MIDI_Tempo_Curve;
+
+typedef struct
+{
+    double beat;              // quater notes since the clock started
+    float bpm;
+    MIDI_Tempo_Curve curve;
+} MIDI_Tempo_Point;
+
+#define MIDI_TEMPO_MIN_BPM 1.0
+#define MIDI_TEMPO_MAX_BPM 999.0
+/* Master clock tempo, only touched with the controller mutex held. Step intervals are 32.32 fixed point ns
+ * so fractions of a nanosecond add up instead of drifting */
+typedef struct
+{
+    double bpm;               // tempo of the step at position
+    uint64_t interval_fp;     // ns per step at bpm, 32.32 fixed point
+    uint64_t position;        // steps since the clock started
+    uint64_t ramp_start;      // step the ramp began on, ramps run for ramp_length steps
+    uint64_t ramp_length;     // 0 holds bpm
+    double ramp_from;
+    double ramp_to;
+    MIDI_Tempo_Curve ramp_curve;
+    MIDI_Tempo_Point* map;
+    uint32_t map_count;
+    uint32_t map_next;        // first point not reached yet
+} MIDI_Tempo;
+
 typedef struct MIDI_Controller
 {
-    MIDI_Command commands[MIDI_COMMAND_MAX_COUNT];
-    uint8_t commands_processed;
-    uint8_t command_count;
-    uint8_t flags;
+    MIDI_Command_Queue commands;
+    uint16_t flags;
     uint8_t clock_mode;
+    /* 1-byte hole */
     uint16_t active_channels;
     int midi_external_output;
     int midi_external_input;
-    /* 4-byte hole */
+    int shutdown_event;         // eventfd written on destroy to wake threads blocked in poll
+    _Atomic uint32_t tick_count; // clock ticks since setup, only written with the mutex held, consumers read it instead of 0xF8 events
+    _Atomic uint8_t transport;   // MIDI_Transport, set by start/stop/continue
+    uint64_t tick_timestamp_ns; // time of the latest clock tick, sequenced commands are stamped with it
+    uint32_t clock_step;        // internal clock steps since the last midi clock tick went out
+    uint32_t pending_steps;     // steps the midi thread still has to run
+    uint32_t lookahead_ticks;   // midi clock ticks the internal clock runs ahead of the deadlines it stamps
+    MIDI_Tempo tempo;
+    uint32_t sender_spin_ns;
+    MIDI_Outbound_Queue outbound;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    pthread_cond_t cond;        // wakes the midi thread on every clock tick
+    pthread_cond_t clock_cond;  // CLOCK_MONOTONIC, the master clock waits on it between ticks so destroy can wake it
+    pthread_cond_t send_cond;   // CLOCK_MONOTONIC, the sender thread sleeps on it until a deadline or new output
+    pthread_t midi_thread;
+    pthread_t input_thread;
+    pthread_t clock_thread;
+    pthread_t sender_thread;
+    MIDI_Thread_Report midi_thread_report;
+    MIDI_Thread_Report input_thread_report;
+    MIDI_Thread_Report clock_thread_report;
+    MIDI_Thread_Report sender_thread_report;
+    struct MIDI_Recorder* recorder; // running recorder, stopped by destroy
     Input_Controller midi_commands;
 } MIDI_Controller;
 
@@ -148,11 +399,96 @@ typedef struct MIDI_Controller
 #define EXTERNAL_INPUT_CLOCK    (1<<1)
 #define EXTERNAL_INPUT_THROUGH  (1<<2)
 
+typedef enum
+{
+    MIDI_TICK_ENGINE_THREAD = 0, // clock ticks wake the midi thread which launches the sequenced commands
+    MIDI_TICK_ENGINE_INLINE = 1  // the thread delivering the tick launches them itself, no hand off or second wake up
+} MIDI_Tick_Engine;
+
+typedef enum
+{
+    MIDI_TRANSPORT_STOPPED = 0,
+    MIDI_TRANSPORT_PLAYING = 1
+} MIDI_Transport;
+
+/* Optional settings for midi_controller_set_config, zero values use the defaults */
+typedef struct
+{
+    uint32_t command_capacity; // size of the command queue, rounded up to a power of two
+    MIDI_Thread_Config thread_config; // applied to the midi thread and the external input thread
+    MIDI_Tick_Engine tick_engine;
+    MIDI_Overflow_Policy overflow_policy;
+    uint32_t burst_limit;      // most events one track launches on the same tick, MIDI_DEFAULT_BURST_LIMIT if 0
+    uint32_t ppqn;             // sequencer resolution, a multiple of 24 such as 96, 480 or 960. MIDI_DEFAULT_PPQN if 0
+    MIDI_Step_Engine_ISA step_engine_isa; // override the cpuid pick, falls back if the CPU can't run it
+    MIDI_Step_Scheduler scheduler;
+    uint32_t lookahead_ticks;  // midi clock ticks the internal clock renders ahead, a sender thread writes the output at its deadline. 0 is off
+    uint32_t sender_spin_ns;   // MIDI_DEFAULT_SPIN_NS if 0
+} MIDI_Controller_Config;
+
+/* Records everything going through the command queue, sequenced, through and sent, to type 1 midi files */
+#define MIDI_RECORDER_DIVISION 960      // ticks per quater note in the files
+#define MIDI_RECORDER_TEMPO_US 500000   // tempo written to the files, 120 bpm so a tick is ~0.52 ms of real time
+#define MIDI_RECORDER_TRACKS 17         // tempo track then one per channel
+#define MIDI_RECORDER_DEFAULT_PERIOD_MS 10
+typedef struct
+{
+    const char* path;         // files are written to path_000.mid, path_001.mid...
+    uint64_t max_bytes;       // start a new file once this much has been recorded, 0 no limit
+    uint32_t max_seconds;     // start a new file every max_seconds, 0 no limit
+    uint32_t period_ms;       // how often the queue is read, MIDI_RECORDER_DEFAULT_PERIOD_MS if 0
+} MIDI_Recorder_Config;
+
+typedef struct
+{
+    uint8_t* data;
+    uint32_t length;
+    uint32_t capacity;
+    uint64_t last_tick;
+    uint8_t running_status;
+} MIDI_Recorder_Track;
+
+/* Only the recorder thread touches the tracks, the counters can be read once stopped */
+typedef struct MIDI_Recorder
+{
+    MIDI_Controller* controller;
+    int consumer;             // skip ahead consumer, the recorder can fall behind but never holds anything up
+    char* path;
+    uint64_t max_bytes;
+    uint64_t max_ns;
+    uint32_t period_ms;
+    uint64_t file_start_ns;   // time of tick 0 in the file being recorded
+    uint64_t file_bytes;
+    MIDI_Recorder_Track tracks[MIDI_RECORDER_TRACKS];
+    _Atomic uint8_t running;
+    pthread_t thread;
+    uint64_t events;          // written to files
+    uint32_t files;
+    uint32_t skipped;         // lost because the recorder was a whole queue behind, raise command_capacity if not 0
+} MIDI_Recorder;
+
 /* Initalise the midi_controller on the stack and pass the address to the setup function */
 MIDI_INLINE int midi_controller_set(MIDI_Controller* controller, const char* filepath, const char* midi_external, const uint8_t external_midi_set_up); // both filepath and midi_external can be NULL if not using
+MIDI_INLINE int midi_controller_set_config(MIDI_Controller* controller, const char* filepath, const char* midi_external, const uint8_t external_midi_set_up, const MIDI_Controller_Config* config); // config can be NULL for defaults
 /* Initalise the internal midi clock */
 MIDI_INLINE void midi_clock_set(MIDI_Controller* controller, const float bpm);
-/* Call when exiting to program to clean up the midi_thread and parsed command nodes */
+MIDI_INLINE void midi_clock_set_config(MIDI_Controller* controller, const float bpm, const MIDI_Thread_Config* thread_config); // thread_config can be NULL, a running clock just changes tempo
+/* Live tempo of the internal clock, applied from the next step. Both cancel a tempo map */
+MIDI_INLINE void midi_tempo_set(MIDI_Controller* controller, const float bpm);
+MIDI_INLINE void midi_tempo_ramp(MIDI_Controller* controller, const float bpm, const double beats, const MIDI_Tempo_Curve curve);
+/* Tempo automation by song position, points sorted by beat. The map is copied, count 0 clears it. Returns -1 if unsorted */
+MIDI_INLINE int midi_tempo_map_set(MIDI_Controller* controller, const MIDI_Tempo_Point* points, const uint32_t count);
+MIDI_INLINE float midi_tempo_bpm(MIDI_Controller* controller);
+/* Parses and compiles a new pattern file on the calling thread without holding up the sequencer, then has it swapped in
+ * on the next step that is a multiple of bars bars of the playing pattern since it started (pass the loop length to
+ * swap on loop boundaries). The bar is the playing pattern's first track's time signature, 4/4 if it has none.
+ * Returns straight away, 0 once handed over, -1 if the file fails or a swap is still pending */
+MIDI_INLINE int midi_pattern_load(MIDI_Controller* controller, const char* filepath, const uint32_t bars);
+MIDI_INLINE int midi_pattern_swap_pending(MIDI_Controller* controller);
+/* Compiles a text pattern or midi file into an image at ppqn. Images load with midi_controller_set and midi_pattern_load
+ * like any pattern file but are mapped instead of parsed. Tempo changes in a midi file aren't kept. Returns 0 or -1 */
+MIDI_INLINE int midi_pattern_image_write(const char* filepath, const char* image_path, const uint32_t ppqn);
+/* Call when exiting to program to clean up the midi_thread and the pattern */
 MIDI_INLINE void midi_controller_destrory(MIDI_Controller* controller);
 
 /* COMMANDS TO CALL */
@@ -161,8 +497,48 @@ MIDI_INLINE void midi_command_clock(MIDI_Controller* controller);  //call this c
 MIDI_INLINE void midi_start(MIDI_Controller* controller);
 MIDI_INLINE void midi_stop(MIDI_Controller* controller);
 MIDI_INLINE void midi_continue(MIDI_Controller* controller); // continues play from stopped possition
-/* Construct and send any midi message to send intern and extern */
-MIDI_INLINE void midi_message_send(MIDI_Controller* controller, const uint8_t command_byte, const uint8_t param1, const uint8_t param2);
+/* Construct and send any midi message to send intern and extern. Returns MIDI_QUEUE_FULL if MIDI_OVERFLOW_REJECT refused it */
+MIDI_INLINE int midi_message_send(MIDI_Controller* controller, const uint8_t command_byte, const uint8_t param1, const uint8_t param2);
+/* Sends a whole chord/batch of messages with one lock and one write to the external device, all stamped with the same time.
+ * Returns count, or MIDI_QUEUE_FULL when MIDI_OVERFLOW_REJECT refused the batch, it's queued and sent whole or not at all */
+MIDI_INLINE int midi_message_send_batch(MIDI_Controller* controller, const MIDI_Command* commands, const uint32_t count);
+
+/* Consumer side of the command queue, never blocks. Returns 1 and fills out_command if a command was waiting, 0 if empty */
+MIDI_INLINE int midi_commands_poll(MIDI_Controller* controller, MIDI_Command* out_command);
+/* Same as midi_commands_poll but keeps the tick and timestamp of the command */
+MIDI_INLINE int midi_events_poll(MIDI_Controller* controller, MIDI_Event* out_event);
+
+/* Extra consumers each see every command from the moment they register. Returns the consumer id or -1 if all are taken */
+MIDI_INLINE int midi_consumer_register(MIDI_Controller* controller, const MIDI_Consumer_Policy policy);
+MIDI_INLINE void midi_consumer_unregister(MIDI_Controller* controller, const int consumer); // can also drop MIDI_DEFAULT_CONSUMER if unused
+MIDI_INLINE int midi_consumer_poll(MIDI_Controller* controller, const int consumer, MIDI_Event* out_event);
+MIDI_INLINE uint32_t midi_consumer_skipped(MIDI_Controller* controller, const int consumer); // events a skip ahead consumer missed
+
+/* Starts a thread writing the command queue to midi files, timed by the event timestamps. Returns 0, or -1 if no consumer
+ * or thread was free. The recorder must stay in place until midi_recorder_stop, which writes the last file */
+MIDI_INLINE int midi_recorder_start(MIDI_Controller* controller, MIDI_Recorder* recorder, const MIDI_Recorder_Config* config);
+MIDI_INLINE void midi_recorder_stop(MIDI_Recorder* recorder);
+
+/* Clock ticks and transport aren't queued, they are read from here in O(1) however long the consumer was away */
+MIDI_INLINE uint32_t midi_clock_ticks(MIDI_Controller* controller); // clock ticks since setup, wraps at 2^32
+MIDI_INLINE uint32_t midi_consumer_ticks(MIDI_Controller* controller, const int consumer); // ticks since this consumer last asked
+MIDI_INLINE uint32_t midi_ticks_elapsed(MIDI_Controller* controller); // midi_consumer_ticks for MIDI_DEFAULT_CONSUMER
+MIDI_INLINE MIDI_Transport midi_transport_state(MIDI_Controller* controller);
+
+/* Sequencer steps from now with nothing due, how long a clock source can sleep. Only known with MIDI_SCHEDULER_HEAP,
+ * the scan scheduler always returns 0. UINT32_MAX if nothing is ever due */
+MIDI_INLINE uint32_t midi_steps_until_next_event(MIDI_Controller* controller);
+/* Instruction set the step engine was set up with */
+MIDI_INLINE MIDI_Step_Engine_ISA midi_step_engine_isa(MIDI_Controller* controller);
+
+/* Overflow counters and high water mark, for sizing command_capacity under real load */
+MIDI_INLINE void midi_queue_stats(MIDI_Controller* controller, MIDI_Queue_Stats* out_stats);
+MIDI_INLINE void midi_queue_stats_reset(MIDI_Controller* controller);
+
+/* Timing helpers */
+MIDI_INLINE uint64_t midi_time_now_ns(void); // CLOCK_MONOTONIC in nanoseconds, the same clock events are stamped with
+/* Frame offset of the event inside an audio block starting at block_start_ns, clamped to 0 - block_frames-1 */
+MIDI_INLINE uint32_t midi_event_sample_offset(const MIDI_Event* event, const uint64_t block_start_ns, const uint32_t sample_rate, const uint32_t block_frames);
 
 /* Helper functions */
 MIDI_INLINE void midi_command_byte_parse(const uint8_t commmand_byte, uint8_t* out_type, uint8_t* out_channel);
@@ -218,508 +594,2475 @@ MIDI_INLINE void print_binary_8(const uint8_t var_8)
     printf("\n");
 }
 
-typedef enum
+MIDI_INLINE uint32_t midi_next_power_of_two(uint32_t value)
 {
-    MIDI_CLOCK_MODE_MASTER   = (1<<0), // the interface is responsible for the clock
-    MIDI_CLOCK_MODE_EXTERNAL = (1<<1), // externally connected device is responsible for the clock
-    MIDI_CLOCK_MODE_INTERNAL = (1<<2)  // connected application is responsible for the clock
-} MIDI_Controller_CLock_Mode;
+    if (value <= 1)
+        return 1;
+    --value;
+    value |= value >> 1;
+    value |= value >> 2;
+    value |= value >> 4;
+    value |= value >> 8;
+    value |= value >> 16;
+    return value + 1;
+}
 
-MIDI_INLINE void midi_command_launch(MIDI_Controller* controller, const uint8_t channel)
+MIDI_INLINE int midi_command_queue_init(MIDI_Command_Queue* queue, const uint32_t capacity, const MIDI_Overflow_Policy overflow_policy)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT && "ERROR - comomand limit reached");
-
-    Input_Controller* input_controller = &controller->midi_commands;
+    const uint32_t size = midi_next_power_of_two(capacity == 0 ? MIDI_COMMAND_DEFAULT_CAPACITY : capacity);
+    queue->buffer = (MIDI_Event*)calloc(size, sizeof(MIDI_Event));
+    if (queue->buffer == NULL)
+        return -1;
+    queue->mask = size - 1;
+    queue->overflow_policy = overflow_policy;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->high_water, 0);
+    atomic_init(&queue->dropped, 0);
+    atomic_init(&queue->rejected, 0);
+    atomic_init(&queue->overwritten, 0);
+    for (uint8_t i = 0; i < MIDI_MAX_CONSUMERS; ++i)
+    {
+        atomic_init(&queue->consumers[i].cursor, 0);
+        atomic_init(&queue->consumers[i].skipped, 0);
+        atomic_init(&queue->consumers[i].active, 0);
+        queue->consumers[i].policy = MIDI_CONSUMER_BLOCKING;
+    }
+    atomic_store_explicit(&queue->consumers[MIDI_DEFAULT_CONSUMER].active, 1, memory_order_release);
+    return 0;
+}
 
-    //put command into queue and send extern if connected. Move node to the next, and assign the command step
-    MIDI_Command command = input_controller->channel[channel]->command;
-    controller->commands[controller->command_count++] = command;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-        write(controller->midi_external_output, &command, sizeof(MIDI_Command));
-    input_controller->channel[channel] = input_controller->channel[channel]->next;
-    input_controller->next_command[channel] = input_controller->channel[channel]->on_tick;
+MIDI_INLINE void midi_command_queue_free(MIDI_Command_Queue* queue)
+{
+    free(queue->buffer);
+    queue->buffer = NULL;
+    queue->mask = 0;
 }
 
-MIDI_INLINE uint16_t midi_merge_mask(const uint32_t comparision_mask, const uint16_t active_channels)
+/* Free slots before the slowest blocking consumer would be overrun, must be called with the controller mutex held */
+MIDI_INLINE uint32_t midi_command_queue_space(MIDI_Command_Queue* queue)
 {
-    uint16_t result = 0;
-    uint8_t channel = 0;
-    for (uint8_t i = 0; i < 32; i += 2)
+    const uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t waiting = 0;
+    for (uint8_t i = 0; i < MIDI_MAX_CONSUMERS; ++i)
     {
-        if (comparision_mask & (1<<i) && active_channels & (1<<channel))
-            result |= (1<<channel);
-        ++channel;
+        MIDI_Consumer* consumer = &queue->consumers[i];
+        if (!atomic_load_explicit(&consumer->active, memory_order_relaxed) || consumer->policy != MIDI_CONSUMER_BLOCKING)
+            continue;
+        const uint32_t behind = head - atomic_load_explicit(&consumer->cursor, memory_order_acquire);
+        if (behind > waiting)
+            waiting = behind;
     }
-    return result;
+    return waiting > queue->mask ? 0 : queue->mask + 1 - waiting;
 }
 
-#define __AVX2__
-MIDI_INLINE void midi_increment_step_count_simd(MIDI_Controller* controller)
+/* Producer side, must be called with the controller mutex held. Returns MIDI_QUEUE_FULL when the event wasn't queued and the policy wants the caller told */
+MIDI_INLINE int midi_command_queue_push(MIDI_Command_Queue* queue, const MIDI_Event* event)
 {
-#ifdef __AVX2__
-
-    //load in current steps
-    __m256i current_steps = _mm256_loadu_si256((__m256i*)controller->midi_commands.current_step);
-
-    // checking for commands to launch
-    __m256i next_command = _mm256_loadu_si256((__m256i*)controller->midi_commands.next_command);
-    __m256i comparision = _mm256_cmpeq_epi16(next_command, current_steps);
-    uint32_t comparision_mask = _mm256_movemask_epi8(comparision);
-    uint16_t active_mask = midi_merge_mask(comparision_mask, controller->active_channels);
-    //print_binary_32(comparision_mask);
-    //print_binary_16(active_mask);
-    if(active_mask != 0)
+    const uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    const uint32_t space = midi_command_queue_space(queue);
+    if (space == 0)
     {
-        for(uint8_t i = 0; i < 16; ++i)
+        DEBUG_PRINT("WARNING - command queue full, policy %u, command %02x\n", queue->overflow_policy, event->command.command_byte);
+        switch (queue->overflow_policy)
         {
-            if (active_mask & (1<<i))
-                midi_command_launch(controller, i);
+        case MIDI_OVERFLOW_DROP_OLDEST:
+            atomic_fetch_add_explicit(&queue->overwritten, 1, memory_order_relaxed);
+            break; // written over the oldest slot below, consumers notice they were lapped
+        case MIDI_OVERFLOW_REJECT:
+            atomic_fetch_add_explicit(&queue->rejected, 1, memory_order_relaxed);
+            return MIDI_QUEUE_FULL;
+        default:
+            atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+            return 0;
         }
     }
-
-    // AVX2: 16 elements in one operation
-    //printf("AVX2 increment\n");
-    //increment
-    __m256i ones = _mm256_set1_epi16(1);
-    __m256i after_increment = _mm256_add_epi16(current_steps, ones);
-
-    //check loop_steps and reset if over
-    __m256i loop_steps = _mm256_loadu_si256((__m256i*)controller->midi_commands.loop_steps);
-
-    /* need to check with flipping the bit as no uint16 gt comparision on AVX2 */
-    __m256i sign_flip = _mm256_set1_epi16((int16_t)0x8000);  // 0x8000 = -32768
-    __m256i a_signed = _mm256_xor_si256(loop_steps, sign_flip);
-    __m256i b_signed = _mm256_xor_si256(after_increment, sign_flip);
-    __m256i gt_mask = _mm256_cmpgt_epi16(b_signed, a_signed);
-
-    __m256i new_step = _mm256_blendv_epi8(after_increment, _mm256_setzero_si256(), gt_mask);
-    _mm256_storeu_si256((__m256i*)controller->midi_commands.current_step, new_step);
-
-#else
-    // Scalar fallback
-    for(int i = 0; i < 16; ++i)
-    {
-        if (controller->midi_commands.current_step[i] == controller->midi_commands.next_command[i] && controller->active_channels & (1<<i))
-            midi_command_launch(controller, i);
-    }
-    for (int i = 0; i < 16; ++i)
-    {
-        ++controller->midi_commands.current_step[i];
-        if (controller->midi_commands.current_step[i] > controller->midi_commands.loop_steps[i])
-            controller->midi_commands.current_step[i] = 0;
-    }
-#endif
+    // lapped consumers may be reading the slot being reused, they check head again after copying
+    atomic_thread_fence(memory_order_release);
+    queue->buffer[head & queue->mask] = *event;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    const uint32_t waiting = queue->mask + 2 - (space == 0 ? 1 : space);
+    if (waiting > atomic_load_explicit(&queue->high_water, memory_order_relaxed))
+        atomic_store_explicit(&queue->high_water, waiting, memory_order_relaxed);
+    return 0;
 }
 
-
-MIDI_INLINE void* midi_thread_loop(void* arg)
+/* Stamps the command with the current tick and pushes it, must be called with the controller mutex held */
+MIDI_INLINE int midi_event_push(MIDI_Controller* controller, const MIDI_Command command, const uint64_t timestamp_ns)
 {
-    MIDI_Controller* controller = (MIDI_Controller*)arg;
+    const MIDI_Event event = {command, atomic_load_explicit(&controller->tick_count, memory_order_relaxed), timestamp_ns};
+    return midi_command_queue_push(&controller->commands, &event);
+}
 
+MIDI_INLINE int midi_consumer_poll(MIDI_Controller* controller, const int consumer_id, MIDI_Event* out_event)
+{
+    MIDI_Command_Queue* queue = &controller->commands;
+    MIDI_Consumer* consumer = &queue->consumers[consumer_id];
+    uint32_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
     while (1)
     {
-        pthread_mutex_lock(&controller->mutex);
-        while(!(controller->flags & MIDI_CLOCK_COMMAND_SENT))
-            pthread_cond_wait(&controller->cond, &controller->mutex);
-        controller->flags &= ~MIDI_CLOCK_COMMAND_SENT;
+        const uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (cursor == head)
+            return 0;
 
-        //destory thread if flag is set
-        if(controller->flags & MIDI_INTERFACE_DESTORY)
+        if (consumer->policy == MIDI_CONSUMER_BLOCKING && queue->overflow_policy != MIDI_OVERFLOW_DROP_OLDEST)
         {
-            pthread_mutex_unlock(&controller->mutex);
+            *out_event = queue->buffer[cursor & queue->mask];
             break;
         }
 
-        midi_increment_step_count_simd(controller);
-
-        DEBUG_PRINT("Commands processed: %u\n", controller->commands_processed);
-        //push processed commands
-        if (controller->commands_processed > 0)
+        // lapped by the producer, jump to the oldest event still in the ring
+        if (head - cursor > queue->mask)
         {
-            uint8_t difference = controller->command_count - controller->commands_processed;
-            DEBUG_PRINT("command count: %u, processed count: %u, dif %u\n", controller->command_count, controller->commands_processed, difference);
-            assert(controller->command_count >= controller->commands_processed && "ERROR - More commands processed then count\n");
-            memmove(&controller->commands[0], &controller->commands[controller->commands_processed], difference * sizeof(MIDI_Command));
-            memset(&controller->commands[difference], 0, controller->commands_processed);
-
-            controller->commands_processed = 0;
-            controller->command_count = difference;
+            const uint32_t oldest = head - queue->mask;
+            atomic_fetch_add_explicit(&consumer->skipped, oldest - cursor, memory_order_relaxed);
+            cursor = oldest;
         }
-
-
-        pthread_mutex_unlock(&controller->mutex);
+        *out_event = queue->buffer[cursor & queue->mask];
+        atomic_thread_fence(memory_order_acquire);
+        // the slot may have been reused while copying, retry from the new oldest event if so
+        if (atomic_load_explicit(&queue->head, memory_order_relaxed) - cursor <= queue->mask)
+            break;
     }
-
-    DEBUG_PRINT("MIDI interface thread exiting\n", "");
-
-    return NULL;
+    atomic_store_explicit(&consumer->cursor, cursor + 1, memory_order_release);
+    return 1;
 }
 
+MIDI_INLINE int midi_events_poll(MIDI_Controller* controller, MIDI_Event* out_event)
+{
+    return midi_consumer_poll(controller, MIDI_DEFAULT_CONSUMER, out_event);
+}
 
-
-MIDI_INLINE void midi_controller_destrory(MIDI_Controller* controller)
+MIDI_INLINE int midi_consumer_register(MIDI_Controller* controller, const MIDI_Consumer_Policy policy)
 {
+    MIDI_Command_Queue* queue = &controller->commands;
+    int consumer_id = -1;
     pthread_mutex_lock(&controller->mutex);
-    controller->flags |= (MIDI_INTERFACE_DESTORY | MIDI_CLOCK_COMMAND_SENT);
-    pthread_cond_signal(&controller->cond);
-    pthread_mutex_unlock(&controller->mutex);
-
-    for (uint8_t i = 0; i < MIDI_MAX_CHANNELS; ++i)
+    for (uint8_t i = 0; i < MIDI_MAX_CONSUMERS; ++i)
     {
-        if (controller->active_channels & (1<<i))
-        {
-            Channel_Node* node = controller->midi_commands.channel[i];
-            for (uint8_t j = 0; j < controller->midi_commands.node_count[i]; ++j)
-            {
-                Channel_Node* node_to_free = node;
-                node = node->next;
-                free(node_to_free);
-            }
-        }
+        MIDI_Consumer* consumer = &queue->consumers[i];
+        if (atomic_load_explicit(&consumer->active, memory_order_relaxed))
+            continue;
+        // start at the head so the new consumer doesn't hold back slots it never saw
+        atomic_store_explicit(&consumer->cursor, atomic_load_explicit(&queue->head, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&consumer->skipped, 0, memory_order_relaxed);
+        consumer->policy = policy;
+        consumer->last_tick = atomic_load_explicit(&controller->tick_count, memory_order_relaxed);
+        atomic_store_explicit(&consumer->active, 1, memory_order_release);
+        consumer_id = i;
+        break;
     }
-    sleep(1); //waits a second to ensure other threads can finish up
+    pthread_mutex_unlock(&controller->mutex);
+    if (consumer_id < 0)
+        printf(MIDI_COLOR_YELLOW "WARNING - no free command queue consumers\n" MIDI_COLOR_RESET);
+    return consumer_id;
+}
+
+MIDI_INLINE void midi_consumer_unregister(MIDI_Controller* controller, const int consumer)
+{
+    assert(consumer >= 0 && consumer < MIDI_MAX_CONSUMERS && "ERROR - invalid consumer id");
     pthread_mutex_lock(&controller->mutex);
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-        close(controller->midi_external_output);
-    if (controller->flags & MIDI_EXTERNAL_INPUT)
-        close(controller->midi_external_input);
+    atomic_store_explicit(&controller->commands.consumers[consumer].active, 0, memory_order_release);
     pthread_mutex_unlock(&controller->mutex);
 }
 
-MIDI_INLINE Channel_Node* midi_command_node(const uint8_t command_byte, const uint8_t param1, const uint8_t param2, const uint16_t on_tick)
+MIDI_INLINE uint32_t midi_consumer_skipped(MIDI_Controller* controller, const int consumer)
 {
-    //allowing for const members to be set
-    Channel_Node node_heap = {{command_byte, param1, param2}, on_tick, NULL};
-    Channel_Node* node = malloc(sizeof(Channel_Node));
-    memcpy(node, &node_heap, sizeof(Channel_Node));
+    return atomic_load_explicit(&controller->commands.consumers[consumer].skipped, memory_order_relaxed);
+}
 
-    return node;
+MIDI_INLINE uint32_t midi_clock_ticks(MIDI_Controller* controller)
+{
+    return atomic_load_explicit(&controller->tick_count, memory_order_acquire);
 }
 
-#define LOOP_SAFETY_TRIGGERED -9999
-MIDI_INLINE int midi_place_next_node(Channel_Node* first_node, Channel_Node* next_node)
+MIDI_INLINE uint32_t midi_consumer_ticks(MIDI_Controller* controller, const int consumer)
 {
-    Channel_Node* node = first_node;
-    int safety = 0;
+    MIDI_Consumer* c = &controller->commands.consumers[consumer];
+    const uint32_t now = atomic_load_explicit(&controller->tick_count, memory_order_acquire);
+    const uint32_t elapsed = now - c->last_tick;
+    c->last_tick = now;
+    return elapsed;
+}
 
-    while (node->next != NULL && safety < 1000)
-    {
-        node = node->next;
-        ++safety;
-    }
+MIDI_INLINE uint32_t midi_ticks_elapsed(MIDI_Controller* controller)
+{
+    return midi_consumer_ticks(controller, MIDI_DEFAULT_CONSUMER);
+}
 
-    if (safety == 1000)
-        return LOOP_SAFETY_TRIGGERED;
+MIDI_INLINE MIDI_Transport midi_transport_state(MIDI_Controller* controller)
+{
+    return (MIDI_Transport)atomic_load_explicit(&controller->transport, memory_order_acquire);
+}
 
-    node->next = next_node;
+MIDI_INLINE void midi_queue_stats(MIDI_Controller* controller, MIDI_Queue_Stats* out_stats)
+{
+    MIDI_Command_Queue* queue = &controller->commands;
+    out_stats->capacity = queue->mask + 1;
+    out_stats->high_water = atomic_load_explicit(&queue->high_water, memory_order_relaxed);
+    out_stats->dropped = atomic_load_explicit(&queue->dropped, memory_order_relaxed);
+    out_stats->rejected = atomic_load_explicit(&queue->rejected, memory_order_relaxed);
+    out_stats->overwritten = atomic_load_explicit(&queue->overwritten, memory_order_relaxed);
+}
 
-    return 0;
+MIDI_INLINE void midi_queue_stats_reset(MIDI_Controller* controller)
+{
+    MIDI_Command_Queue* queue = &controller->commands;
+    pthread_mutex_lock(&controller->mutex); // the high water mark is only written by producers holding the lock
+    atomic_store_explicit(&queue->high_water, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->rejected, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->overwritten, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&controller->mutex);
 }
 
-MIDI_INLINE MIDI_Channels midi_channel_parse(const uint8_t channel)
+MIDI_INLINE int midi_commands_poll(MIDI_Controller* controller, MIDI_Command* out_command)
 {
-    switch (channel)
-    {
-    case 1:
-        return MIDI_CHANNEL_1;
-    case 2:
-        return MIDI_CHANNEL_2;
-    case 3:
-        return MIDI_CHANNEL_3;
-    case 4:
-        return MIDI_CHANNEL_4;
-    case 5:
-        return MIDI_CHANNEL_5;
-    case 6:
-        return MIDI_CHANNEL_6;
-    case 7:
-        return MIDI_CHANNEL_7;
-    case 8:
-        return MIDI_CHANNEL_8;
-    case 9:
-        return MIDI_CHANNEL_9;
-    case 10:
-        return MIDI_CHANNEL_10;
-    case 11:
-        return MIDI_CHANNEL_11;
-    case 12:
-        return MIDI_CHANNEL_12;
-    case 13:
-        return MIDI_CHANNEL_13;
-    case 14:
-        return MIDI_CHANNEL_14;
-    case 15:
-        return MIDI_CHANNEL_15;
-    case 16:
-        return MIDI_CHANNEL_16;
-    default:
-        assert(0 && "ERROR - Invalid Channel parsed\n");
-        return MIDI_CHANNEL_UNDEFINED;
-    }
+    MIDI_Event event;
+    if (!midi_events_poll(controller, &event))
+        return 0;
+    *out_command = event.command;
+    return 1;
 }
 
-enum
+#define MIDI_NSEC_PER_SEC 1000000000L
+MIDI_INLINE uint64_t midi_time_now_ns(void)
 {
-    LINE_NOT_DEFINED = 0,
-    LINE_CHANNEL = 1,
-    LINE_LOOP = 2, //how many bars in the whole loop
-    LINE_SEQUENCE = 3
-};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * MIDI_NSEC_PER_SEC + now.tv_nsec;
+}
 
-MIDI_INLINE MIDI_Command_type midi_get_command_sequence(const char* command)
+MIDI_INLINE uint64_t midi_timespec_to_ns(const struct timespec* time)
 {
-    if (strncmp(command, "ON", 2) == 0)
-        return MIDI_NOTE_ON;
-    else if (strncmp(command, "OFF", 3) == 0)
-        return MIDI_NOTE_OFF;
-    else if (command[0] == '#')
-        return MIDI_PARSE_DIRECT_HEX;
-    else
-        return MIDI_COMMAND_INVALID;
+    return (uint64_t)time->tv_sec * MIDI_NSEC_PER_SEC + time->tv_nsec;
 }
 
-MIDI_INLINE int midi_parse_commands(MIDI_Controller* controller, const char* filepath)
+MIDI_INLINE struct timespec midi_ns_to_timespec(const uint64_t time_ns)
 {
-    FILE* file = fopen(filepath, "r");
-    if (file == 0)
+    const struct timespec time = {(time_t)(time_ns / MIDI_NSEC_PER_SEC), (long)(time_ns % MIDI_NSEC_PER_SEC)};
+    return time;
+}
+
+MIDI_INLINE uint32_t midi_event_sample_offset(const MIDI_Event* event, const uint64_t block_start_ns, const uint32_t sample_rate, const uint32_t block_frames)
+{
+    if (block_frames == 0 || event->timestamp_ns <= block_start_ns)
+        return 0;
+
+    // whole seconds and the remainder are scaled separately so the multiply can't overflow
+    const uint64_t elapsed_ns = event->timestamp_ns - block_start_ns;
+    const uint64_t frames = (elapsed_ns / MIDI_NSEC_PER_SEC) * sample_rate
+                            + ((elapsed_ns % MIDI_NSEC_PER_SEC) * sample_rate) / MIDI_NSEC_PER_SEC;
+    return frames >= block_frames ? block_frames - 1 : (uint32_t)frames;
+}
+
+/* Number of bytes the message takes on the wire, so two byte messages don't send a stray data byte */
+MIDI_INLINE uint8_t midi_command_length(const uint8_t command_byte)
+{
+    switch (command_byte & MIDI_COMMAND_TYPE_BYTE_MASK)
     {
-        printf(MIDI_COLOR_RED "ERROR - midi commands file cannot be opened\n" MIDI_COLOR_RESET);
-        return -1;
+    case MIDI_PATCH_CHANGE:
+    case MIDI_CHANEL_PRESSURE:
+        return 2;
+    case MIDI_SYSTEM_MESSAGE:
+        if (command_byte == 0xF1 || command_byte == 0xF3) // time code quarter frame, song select
+            return 2;
+        if (command_byte == 0xF2) // song position pointer
+            return 3;
+        return 1;
+    default:
+        return 3;
     }
+}
 
-    char buffer[1000];
-    memset(buffer, 0, sizeof(char) * 1000);
-
-    int channel = -1;
-    uint8_t line = LINE_NOT_DEFINED;
-    uint32_t loop_ticks;
+typedef enum
+{
+    MIDI_CLOCK_MODE_MASTER   = (1<<0), // the interface is responsible for the clock
+    MIDI_CLOCK_MODE_EXTERNAL = (1<<1), // externally connected device is responsible for the clock
+    MIDI_CLOCK_MODE_INTERNAL = (1<<2)  // connected application is responsible for the clock
+} MIDI_Controller_CLock_Mode;
 
-    while (fgets(buffer, sizeof(buffer), file) != NULL)
+/* Sends the commands extern with as few writev calls as IOV_MAX allows, normally one. Must be called with the controller mutex held */
+#define MIDI_BATCH_IOV_MAX 1024
+MIDI_INLINE void midi_message_write_batch(MIDI_Controller* controller, const MIDI_Command* commands, const uint32_t count)
+{
+    struct iovec iov[MIDI_BATCH_IOV_MAX];
+    uint32_t sent = 0;
+    while (sent < count)
     {
-        if (buffer[0] == '{')
+        const uint32_t chunk = (count - sent) < MIDI_BATCH_IOV_MAX ? (count - sent) : MIDI_BATCH_IOV_MAX;
+        for (uint32_t i = 0; i < chunk; ++i)
         {
-            line = LINE_CHANNEL;
-            continue;
+            iov[i].iov_base = (void*)&commands[sent + i];
+            iov[i].iov_len = midi_command_length(commands[sent + i].command_byte);
         }
-        else if (buffer[0] == '}')
+        if (writev(controller->midi_external_output, iov, chunk) < 0)
         {
-            channel = -1;
-            line = LINE_NOT_DEFINED;
-            continue;
+            DEBUG_PRINT("WARNING - writev to external output failed: %d\n", errno);
+            return;
         }
+        sent += chunk;
+    }
+}
 
-        DEBUG_PRINT("\nBuffer: %s", buffer);
+/* Sequenced output, written straight away or with lookahead queued for the sender thread to write at the tick's deadline.
+ * Must be called with the controller mutex held */
+MIDI_INLINE void midi_sequenced_write_locked(MIDI_Controller* controller, const MIDI_Command* commands, const uint32_t count)
+{
+    if (!(controller->flags & MIDI_LOOKAHEAD))
+    {
+        midi_message_write_batch(controller, commands, count);
+        return;
+    }
+    MIDI_Outbound_Queue* outbound = &controller->outbound;
+    uint32_t head = atomic_load_explicit(&outbound->head, memory_order_relaxed);
+    const uint32_t tail = atomic_load_explicit(&outbound->tail, memory_order_acquire);
+    uint32_t queued = 0;
+    for (; queued < count && head - tail <= outbound->mask; ++queued, ++head)
+        outbound->buffer[head & outbound->mask] = (MIDI_Outbound_Event){controller->tick_timestamp_ns, commands[queued]};
+    atomic_store_explicit(&outbound->head, head, memory_order_release);
+    if (outbound->sender_waiting)
+        pthread_cond_signal(&controller->send_cond);
+    if (queued < count)
+    {
+        // sender is a full buffer behind, better early than lost
+        DEBUG_PRINT("WARNING - outbound buffer full, %u commands written early\n", count - queued);
+        midi_message_write_batch(controller, commands + queued, count - queued);
+    }
+}
 
-        switch (line)
-        {
-        case LINE_CHANNEL:
+/* Launches every event due on the track's next tick in one pass, chords go out in one writev.
+ * Past the burst limit the rest of the tick's events are launched on the following ticks */
+MIDI_INLINE void midi_command_launch(MIDI_Controller* controller, const uint32_t track)
+{
+    Input_Controller* input_controller = &controller->midi_commands;
+    MIDI_Pattern* pattern = &input_controller->pattern;
+    const uint32_t track_events = pattern->wrap[track] - pattern->first[track];
+    const uint32_t limit = input_controller->burst_limit < track_events ? input_controller->burst_limit : track_events;
+
+    uint32_t position = pattern->position[track];
+    uint32_t run_start = position;
+    const uint32_t tick = pattern->ticks[position];
+    const uint32_t current_step = pattern->current_step[track];
+    uint32_t launched = 0;
+    int wrapped = 0;
+    do
+    {
+        midi_event_push(controller, pattern->commands[position], controller->tick_timestamp_ns);
+        ++launched;
+        if (++position == pattern->wrap[track])
         {
-            int channel_parse = 0;
-            char tmp[50] = {0};
-            if (sscanf(buffer, "%s %d,", tmp, &channel_parse) != 2)
-                printf(MIDI_COLOR_YELLOW "WARNING: wrong amount of data parsed by %d channel?" MIDI_COLOR_RESET, channel_parse);
+            if ((controller->flags & MIDI_EXTERNAL_CONNECTION) && position > run_start)
+                midi_sequenced_write_locked(controller, &pattern->commands[run_start], position - run_start);
+            position = pattern->first[track];
+            run_start = position;
+            wrapped = 1;
+        }
+    } while (launched < limit && pattern->ticks[position] == tick);
 
-            if (channel_parse >= 1 && channel_parse <= 16)
-            {
-                channel = channel_parse;
-                line = LINE_LOOP;
-            }
-            else
-            {
-                printf(MIDI_COLOR_RED "ERROR - channel parsed incorrectly, check .midi file. %s %d" MIDI_COLOR_RESET, tmp, channel_parse);
-                return -1;
-            }
+    if ((controller->flags & MIDI_EXTERNAL_CONNECTION) && position > run_start)
+        midi_sequenced_write_locked(controller, &pattern->commands[run_start], position - run_start);
+
+    pattern->position[track] = position;
+    // loop pass the next event is in, relative to the one playing. A spill can run on past the end of the loop
+    const int pass = (tick > current_step ? -1 : 0) + wrapped;
+    if (launched < track_events && (pass < 0 || (pass == 0 && pattern->ticks[position] <= current_step)))
+    {
+        // burst limit hit, or the next event fell due while spilling, carry on next tick
+        const uint32_t next_step = current_step + 1;
+        pattern->next_command[track] = next_step > pattern->loop_steps[track] ? 0 : next_step;
+    }
+    else
+        pattern->next_command[track] = pattern->ticks[position];
+}
+
+/* Launches the tracks whose lane bit is set, lowest lane first */
+MIDI_INLINE void midi_launch_lanes(MIDI_Controller* controller, const uint32_t base, uint32_t launch_mask)
+{
+    while (launch_mask)
+    {
+        const uint32_t lane = __builtin_ctz(launch_mask);
+        launch_mask &= launch_mask - 1;
+        midi_command_launch(controller, base + lane);
+    }
+}
+
+/* Step engines, one call moves every track on by one step. Each walks the tracks in blocks of MIDI_TRACK_LANES,
+ * launches the lanes whose step matches their next command, then increments and wraps the steps.
+ * Launching comes first as the burst spill reads the current step */
+static void midi_step_tracks_scalar(MIDI_Controller* controller)
+{
+    MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    for (uint32_t base = 0; base < pattern->lane_count; base += MIDI_TRACK_LANES)
+    {
+        uint32_t* current_step = &pattern->current_step[base];
+        uint32_t launch_mask = 0;
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES; ++i)
+        {
+            if (current_step[i] == pattern->next_command[base + i])
+                launch_mask |= (1u<<i);
+        }
+        midi_launch_lanes(controller, base, launch_mask);
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES; ++i)
+        {
+            ++current_step[i];
+            if (current_step[i] > pattern->loop_steps[base + i])
+                current_step[i] = 0;
+        }
+    }
+}
+
+#ifdef MIDI_X86_DISPATCH
+__attribute__((target("sse2")))
+static void midi_step_tracks_sse2(MIDI_Controller* controller)
+{
+    MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    const __m128i ones = _mm_set1_epi32(1);
+    /* need to check with flipping the bit as no uint32 gt comparision before AVX-512 */
+    const __m128i sign_flip = _mm_set1_epi32((int32_t)0x80000000);
+    for (uint32_t base = 0; base < pattern->lane_count; base += MIDI_TRACK_LANES)
+    {
+        uint32_t* current_step = &pattern->current_step[base];
+        __m128i new_steps[MIDI_TRACK_LANES / 4];
+        uint32_t launch_mask = 0;
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES / 4; ++i)
+        {
+            __m128i current = _mm_loadu_si128((const __m128i*)&current_step[i * 4]);
+            __m128i next = _mm_loadu_si128((const __m128i*)&pattern->next_command[base + i * 4]);
+            launch_mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(next, current))) << (i * 4);
+
+            __m128i after = _mm_add_epi32(current, ones);
+            __m128i loop = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&pattern->loop_steps[base + i * 4]), sign_flip);
+            __m128i wrapped = _mm_cmpgt_epi32(_mm_xor_si128(after, sign_flip), loop);
+            new_steps[i] = _mm_andnot_si128(wrapped, after);
+        }
+        midi_launch_lanes(controller, base, launch_mask);
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES / 4; ++i)
+            _mm_storeu_si128((__m128i*)&current_step[i * 4], new_steps[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void midi_step_tracks_avx2(MIDI_Controller* controller)
+{
+    MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    const __m256i ones = _mm256_set1_epi32(1);
+    const __m256i sign_flip = _mm256_set1_epi32((int32_t)0x80000000);
+    for (uint32_t base = 0; base < pattern->lane_count; base += MIDI_TRACK_LANES)
+    {
+        uint32_t* current_step = &pattern->current_step[base];
+        __m256i new_steps[MIDI_TRACK_LANES / 8];
+        uint32_t launch_mask = 0;
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES / 8; ++i)
+        {
+            __m256i current = _mm256_loadu_si256((const __m256i*)&current_step[i * 8]);
+            __m256i next = _mm256_loadu_si256((const __m256i*)&pattern->next_command[base + i * 8]);
+            launch_mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(next, current))) << (i * 8);
+
+            __m256i after = _mm256_add_epi32(current, ones);
+            __m256i loop = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&pattern->loop_steps[base + i * 8]), sign_flip);
+            __m256i wrapped = _mm256_cmpgt_epi32(_mm256_xor_si256(after, sign_flip), loop);
+            new_steps[i] = _mm256_andnot_si256(wrapped, after);
+        }
+        midi_launch_lanes(controller, base, launch_mask);
+        for (uint32_t i = 0; i < MIDI_TRACK_LANES / 8; ++i)
+            _mm256_storeu_si256((__m256i*)&current_step[i * 8], new_steps[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void midi_step_tracks_avx512(MIDI_Controller* controller)
+{
+    MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    const __m512i ones = _mm512_set1_epi32(1);
+    for (uint32_t base = 0; base < pattern->lane_count; base += MIDI_TRACK_LANES)
+    {
+        // the whole block in one register, compares give the lane mask directly
+        uint32_t* current_step = &pattern->current_step[base];
+        __m512i current = _mm512_loadu_si512((const void*)current_step);
+        const uint32_t launch_mask = _mm512_cmpeq_epu32_mask(_mm512_loadu_si512((const void*)&pattern->next_command[base]), current);
+
+        __m512i after = _mm512_add_epi32(current, ones);
+        __mmask16 wrapped = _mm512_cmpgt_epu32_mask(after, _mm512_loadu_si512((const void*)&pattern->loop_steps[base]));
+        __m512i new_step = _mm512_mask_mov_epi32(after, wrapped, _mm512_setzero_si512());
+
+        midi_launch_lanes(controller, base, launch_mask);
+        _mm512_storeu_si512((void*)current_step, new_step);
+    }
+}
+#endif // MIDI_X86_DISPATCH
+
+MIDI_INLINE int midi_heap_before(const MIDI_Pattern* pattern, const uint32_t a, const uint32_t b)
+{
+    // ties go to the lower track so launches come out in the same order as the scan scheduler
+    return pattern->due[a] < pattern->due[b] || (pattern->due[a] == pattern->due[b] && a < b);
+}
+
+MIDI_INLINE void midi_heap_sift_down(MIDI_Pattern* pattern, uint32_t index)
+{
+    uint32_t* heap = pattern->heap;
+    const uint32_t track = heap[index];
+    while (1)
+    {
+        uint32_t child = 2 * index + 1;
+        if (child >= pattern->heap_size)
+            break;
+        if (child + 1 < pattern->heap_size && midi_heap_before(pattern, heap[child + 1], heap[child]))
+            ++child;
+        if (!midi_heap_before(pattern, heap[child], track))
+            break;
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = track;
+}
+
+/* Heap scheduler, pops the tracks due on this step and pushes them back keyed on their next event.
+ * A step with nothing due is one compare */
+static void midi_step_tracks_heap(MIDI_Controller* controller)
+{
+    MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    const uint64_t step = pattern->step++;
+    while (pattern->heap_size > 0 && pattern->due[pattern->heap[0]] == step)
+    {
+        const uint32_t track = pattern->heap[0];
+        const uint32_t relative_step = (uint32_t)(step - pattern->loop_start[track]);
+        pattern->current_step[track] = relative_step; // the burst spill reads it
+        midi_command_launch(controller, track);
+
+        const uint32_t next = pattern->next_command[track];
+        if (next > pattern->loop_steps[track])
+        {
+            pattern->heap[0] = pattern->heap[--pattern->heap_size];
+            if (pattern->heap_size > 0)
+                midi_heap_sift_down(pattern, 0);
+            continue;
+        }
+        if (next <= relative_step)
+            pattern->loop_start[track] += (uint64_t)pattern->loop_steps[track] + 1;
+        pattern->due[track] = pattern->loop_start[track] + next;
+        midi_heap_sift_down(pattern, 0);
+    }
+}
+
+MIDI_INLINE int midi_step_engine_supported(const MIDI_Step_Engine_ISA isa)
+{
+#ifdef MIDI_X86_DISPATCH
+    __builtin_cpu_init();
+    switch (isa)
+    {
+    case MIDI_STEP_ENGINE_SCALAR:
+        return 1;
+    case MIDI_STEP_ENGINE_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case MIDI_STEP_ENGINE_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case MIDI_STEP_ENGINE_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return 0;
+    }
+#else
+    return isa == MIDI_STEP_ENGINE_SCALAR;
+#endif
+}
+
+/* Picks the step engine once at setup, the requested one if the CPU can run it, otherwise the best it can */
+MIDI_INLINE void midi_step_engine_select(Input_Controller* input_controller, const MIDI_Step_Engine_ISA requested)
+{
+    MIDI_Step_Engine_ISA isa = requested;
+    if (isa != MIDI_STEP_ENGINE_AUTO && !midi_step_engine_supported(isa))
+    {
+        printf(MIDI_COLOR_YELLOW "WARNING - step engine %d not supported by this CPU, picking the best available\n" MIDI_COLOR_RESET, requested);
+        isa = MIDI_STEP_ENGINE_AUTO;
+    }
+    if (isa == MIDI_STEP_ENGINE_AUTO)
+    {
+        isa = MIDI_STEP_ENGINE_AVX512;
+        while (isa > MIDI_STEP_ENGINE_SCALAR && !midi_step_engine_supported(isa))
+            isa = (MIDI_Step_Engine_ISA)(isa - 1);
+    }
+
+    input_controller->step_engine_isa = isa;
+    switch (isa)
+    {
+#ifdef MIDI_X86_DISPATCH
+    case MIDI_STEP_ENGINE_AVX512:
+        input_controller->step_tracks = midi_step_tracks_avx512;
+        break;
+    case MIDI_STEP_ENGINE_AVX2:
+        input_controller->step_tracks = midi_step_tracks_avx2;
+        break;
+    case MIDI_STEP_ENGINE_SSE2:
+        input_controller->step_tracks = midi_step_tracks_sse2;
+        break;
+#endif
+    default:
+        input_controller->step_tracks = midi_step_tracks_scalar;
+    }
+    DEBUG_PRINT("Step engine %d\n", isa);
+}
+
+MIDI_INLINE void midi_increment_step_count_simd(MIDI_Controller* controller)
+{
+    controller->midi_commands.step_tracks(controller);
+}
+
+/* Steps after the ones already handed to the engine with nothing due. Must be called with the controller mutex held */
+MIDI_INLINE uint32_t midi_steps_until_next_event_locked(MIDI_Controller* controller)
+{
+    const MIDI_Pattern* pattern = &controller->midi_commands.pattern;
+    if (controller->midi_commands.step_tracks != midi_step_tracks_heap)
+        return 0;
+    if (pattern->heap_size == 0)
+        return UINT32_MAX;
+    const uint64_t queued = pattern->step + controller->pending_steps;
+    const uint64_t due = pattern->due[pattern->heap[0]];
+    if (due <= queued)
+        return 0;
+    return (due - queued) > UINT32_MAX ? UINT32_MAX : (uint32_t)(due - queued);
+}
+
+MIDI_INLINE uint32_t midi_steps_until_next_event(MIDI_Controller* controller)
+{
+    pthread_mutex_lock(&controller->mutex);
+    const uint32_t steps = midi_steps_until_next_event_locked(controller);
+    pthread_mutex_unlock(&controller->mutex);
+    return steps;
+}
+
+MIDI_INLINE MIDI_Step_Engine_ISA midi_step_engine_isa(MIDI_Controller* controller)
+{
+    return controller->midi_commands.step_engine_isa;
+}
+
+
+/* Creates a thread with the policy and affinity of the config in its attributes, so it never runs without them.
+ * Whatever the system refuses falls back to the default, and the report is ready once this returns */
+MIDI_INLINE int midi_thread_create(pthread_t* thread, void* (*loop)(void*), void* arg, const MIDI_Thread_Config* config, MIDI_Thread_Report* report)
+{
+    memset(report, 0, sizeof(MIDI_Thread_Report));
+    if (config != NULL && config->policy != SCHED_OTHER)
+        report->requested |= MIDI_THREAD_APPLIED_POLICY;
+    if (config != NULL && config->cpu_mask != 0)
+        report->requested |= MIDI_THREAD_APPLIED_AFFINITY;
+
+    uint8_t attributes = report->requested;
+    int result;
+    while (1)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        uint8_t refused = 0; // the attribute that failed
+        result = 0;
+        if (attributes & MIDI_THREAD_APPLIED_POLICY)
+        {
+            struct sched_param param = {0};
+            param.sched_priority = config->priority;
+            result = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            if (result == 0)
+                result = pthread_attr_setschedpolicy(&attr, config->policy);
+            if (result == 0)
+                result = pthread_attr_setschedparam(&attr, &param);
+            if (result != 0)
+                refused = MIDI_THREAD_APPLIED_POLICY;
+        }
+        if (result == 0 && (attributes & MIDI_THREAD_APPLIED_AFFINITY))
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (int i = 0; i < 64; ++i)
+            {
+                if (config->cpu_mask & (1ULL<<i))
+                    CPU_SET(i, &cpus);
+            }
+            result = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+            if (result != 0)
+                refused = MIDI_THREAD_APPLIED_AFFINITY;
+        }
+        if (result == 0)
+        {
+            result = pthread_create(thread, &attr, loop, arg);
+            // missing permissions refuse the policy, cpus that don't exist the affinity
+            if (result == EPERM)
+                refused = attributes & MIDI_THREAD_APPLIED_POLICY;
+            else if (result == EINVAL)
+                refused = (attributes & MIDI_THREAD_APPLIED_AFFINITY) ? MIDI_THREAD_APPLIED_AFFINITY : (attributes & MIDI_THREAD_APPLIED_POLICY);
+        }
+        pthread_attr_destroy(&attr);
+        if (result == 0 || refused == 0)
+            break;
+
+        report->error = result;
+        attributes &= ~refused;
+        if (refused == MIDI_THREAD_APPLIED_POLICY)
+            printf(MIDI_COLOR_YELLOW "WARNING - couldn't set thread scheduling policy %d priority %d (%s), using default\n" MIDI_COLOR_RESET,
+                   config->policy, config->priority, strerror(result));
+        else
+            printf(MIDI_COLOR_YELLOW "WARNING - couldn't set thread cpu affinity (%s), using default\n" MIDI_COLOR_RESET, strerror(result));
+    }
+    if (result != 0)
+        return result;
+    report->applied = attributes;
+
+    if (config != NULL && config->lock_memory)
+    {
+        report->requested |= MIDI_THREAD_APPLIED_MEMLOCK;
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+            report->applied |= MIDI_THREAD_APPLIED_MEMLOCK;
+        else
+        {
+            report->error = errno;
+            printf(MIDI_COLOR_YELLOW "WARNING - couldn't lock memory (%s)\n" MIDI_COLOR_RESET, strerror(errno));
+        }
+    }
+
+    // read back what the thread really runs with
+    struct sched_param param = {0};
+    if (pthread_getschedparam(*thread, &report->policy, &param) == 0)
+        report->priority = param.sched_priority;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (pthread_getaffinity_np(*thread, sizeof(cpu_set_t), &cpus) == 0)
+    {
+        for (int i = 0; i < 64; ++i)
+        {
+            if (CPU_ISSET(i, &cpus))
+                report->cpu_mask |= (1ULL<<i);
+        }
+    }
+    return 0;
+}
+
+MIDI_INLINE void* midi_thread_loop(void* arg)
+{
+    MIDI_Controller* controller = (MIDI_Controller*)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&controller->mutex);
+        while(!(controller->flags & MIDI_CLOCK_COMMAND_SENT))
+            pthread_cond_wait(&controller->cond, &controller->mutex);
+        controller->flags &= ~MIDI_CLOCK_COMMAND_SENT;
+
+        //destory thread if flag is set
+        if(controller->flags & MIDI_INTERFACE_DESTORY)
+        {
+            pthread_mutex_unlock(&controller->mutex);
+            break;
+        }
+
+        // external clocks hand over ppqn/24 steps per tick
+        for (; controller->pending_steps > 0; --controller->pending_steps)
+            midi_increment_step_count_simd(controller);
+
+        pthread_mutex_unlock(&controller->mutex);
+    }
+
+    DEBUG_PRINT("MIDI interface thread exiting\n", "");
+
+    return NULL;
+}
+
+
+
+/* Frees the block, or unmaps it for a pattern image */
+MIDI_INLINE void midi_pattern_free(MIDI_Pattern* pattern)
+{
+    if (pattern->mapping != NULL)
+        munmap(pattern->mapping, pattern->mapping_size);
+    else
+        free(pattern->loop_steps); // every pattern array shares the block
+    memset(pattern, 0, sizeof(MIDI_Pattern));
+}
+
+MIDI_INLINE void midi_controller_destrory(MIDI_Controller* controller)
+{
+    if (controller->recorder != NULL)
+        midi_recorder_stop(controller->recorder); // it reads the queue, so it goes before anything is freed
+
+    pthread_mutex_lock(&controller->mutex);
+    controller->flags |= (MIDI_INTERFACE_DESTORY | MIDI_CLOCK_COMMAND_SENT);
+    const uint16_t running = controller->flags;
+    pthread_cond_signal(&controller->cond);
+    pthread_cond_signal(&controller->clock_cond);
+    pthread_cond_signal(&controller->send_cond);
+    pthread_mutex_unlock(&controller->mutex);
+    if (controller->shutdown_event >= 0)
+        eventfd_write(controller->shutdown_event, 1);
+
+    // every thread has been woken, once joined nothing else touches the controller
+    if (running & MIDI_THREAD_RUNNING)
+        pthread_join(controller->midi_thread, NULL);
+    if (running & MIDI_CLOCK_ENABLED)
+        pthread_join(controller->clock_thread, NULL);
+    if (running & MIDI_EXTERNAL_INPUT)
+        pthread_join(controller->input_thread, NULL);
+    if (running & MIDI_SENDER_RUNNING)
+        pthread_join(controller->sender_thread, NULL);
+
+    midi_pattern_free(&controller->midi_commands.pattern);
+    midi_pattern_free(&controller->midi_commands.next_pattern);
+    midi_pattern_free(&controller->midi_commands.retired_pattern);
+    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
+        close(controller->midi_external_output);
+    if (controller->flags & MIDI_EXTERNAL_INPUT)
+        close(controller->midi_external_input);
+    if (controller->shutdown_event >= 0)
+        close(controller->shutdown_event);
+    controller->shutdown_event = -1;
+    midi_command_queue_free(&controller->commands);
+    free(controller->outbound.buffer);
+    controller->outbound.buffer = NULL;
+    free(controller->tempo.map);
+    memset(&controller->tempo, 0, sizeof(MIDI_Tempo));
+    controller->active_channels = 0;
+    controller->flags = 0;
+
+    pthread_cond_destroy(&controller->send_cond);
+    pthread_cond_destroy(&controller->clock_cond);
+    pthread_cond_destroy(&controller->cond);
+    pthread_mutex_destroy(&controller->mutex);
+}
+
+/* One parsed block of the file, compiled into a track. Its events are [first, first + count) of the parsed arrays */
+typedef struct
+{
+    uint32_t first;
+    uint32_t count;
+    uint32_t loop_ticks;
+    uint8_t channel;
+} MIDI_Track_List;
+
+/* Every track of a text file appends to the same two arrays, which double as they fill, so parsing is linear
+ * in the number of events and the tracks come out already laid out the way the pattern block wants them */
+typedef struct
+{
+    uint32_t* ticks;
+    MIDI_Command* commands;
+    uint32_t count;
+    uint32_t capacity;
+    MIDI_Track_List* tracks;
+    uint32_t track_count;
+    uint32_t track_capacity;
+    uint32_t bar_steps;       // bar of the first track's time signature
+} MIDI_Parsed_Pattern;
+
+MIDI_INLINE int midi_parsed_push(MIDI_Parsed_Pattern* parsed, const uint32_t tick, const MIDI_Command command)
+{
+    if (parsed->count == parsed->capacity)
+    {
+        if (parsed->capacity > UINT32_MAX / 2)
+        {
+            printf(MIDI_COLOR_RED "ERROR - pattern has more than %u events\n" MIDI_COLOR_RESET, parsed->capacity);
+            return -1;
+        }
+        const uint32_t capacity = parsed->capacity ? parsed->capacity * 2 : 1024;
+        uint32_t* ticks = (uint32_t*)realloc(parsed->ticks, (size_t)capacity * sizeof(uint32_t));
+        if (ticks == NULL)
+            return -1;
+        parsed->ticks = ticks;
+        MIDI_Command* commands = (MIDI_Command*)realloc(parsed->commands, (size_t)capacity * sizeof(MIDI_Command));
+        if (commands == NULL)
+            return -1;
+        parsed->commands = commands;
+        parsed->capacity = capacity;
+    }
+    parsed->ticks[parsed->count] = tick;
+    parsed->commands[parsed->count++] = command;
+    return 0;
+}
+
+MIDI_INLINE int midi_parsed_track_add(MIDI_Parsed_Pattern* parsed, const MIDI_Track_List track)
+{
+    if (parsed->track_count == parsed->track_capacity)
+    {
+        const uint32_t capacity = parsed->track_capacity ? parsed->track_capacity * 2 : MIDI_TRACK_LANES;
+        MIDI_Track_List* grown = (MIDI_Track_List*)realloc(parsed->tracks, capacity * sizeof(MIDI_Track_List));
+        if (grown == NULL)
+        {
+            printf(MIDI_COLOR_RED "ERROR - track list allocation failed\n" MIDI_COLOR_RESET);
+            return -1;
+        }
+        parsed->tracks = grown;
+        parsed->track_capacity = capacity;
+    }
+    parsed->tracks[parsed->track_count++] = track;
+    return 0;
+}
+
+MIDI_INLINE void midi_parsed_free(MIDI_Parsed_Pattern* parsed)
+{
+    free(parsed->ticks);
+    free(parsed->commands);
+    free(parsed->tracks);
+    memset(parsed, 0, sizeof(MIDI_Parsed_Pattern));
+}
+
+MIDI_INLINE uint32_t midi_pattern_lane_count(const uint32_t track_count)
+{
+    return (track_count + MIDI_TRACK_LANES - 1) & ~(uint32_t)(MIDI_TRACK_LANES - 1);
+}
+
+/* Bytes of the one block every pattern array lives in, the layout only depends on the two counts */
+MIDI_INLINE size_t midi_pattern_block_size(const uint32_t track_count, const uint32_t event_count)
+{
+    const size_t lane_count = midi_pattern_lane_count(track_count);
+    return 7 * lane_count * sizeof(uint32_t) + 2 * lane_count * sizeof(uint64_t) + (size_t)event_count * sizeof(uint32_t) + lane_count +
+           (size_t)event_count * sizeof(MIDI_Command);
+}
+
+/* Points the pattern arrays into block */
+MIDI_INLINE void midi_pattern_bind(MIDI_Pattern* pattern, uint8_t* block, const uint32_t track_count, const uint32_t event_count)
+{
+    const uint32_t lane_count = midi_pattern_lane_count(track_count);
+    const size_t lane_array = lane_count * sizeof(uint32_t);
+    const size_t lane_array_64 = lane_count * sizeof(uint64_t);
+    pattern->loop_steps = (uint32_t*)block;
+    pattern->current_step = (uint32_t*)(block + lane_array);
+    pattern->next_command = (uint32_t*)(block + 2 * lane_array);
+    pattern->first = (uint32_t*)(block + 3 * lane_array);
+    pattern->wrap = (uint32_t*)(block + 4 * lane_array);
+    pattern->position = (uint32_t*)(block + 5 * lane_array);
+    pattern->due = (uint64_t*)(block + 6 * lane_array); // lane_count is a multiple of 16 so this stays 8 byte aligned
+    pattern->loop_start = (uint64_t*)(block + 6 * lane_array + lane_array_64);
+    pattern->heap = (uint32_t*)(block + 6 * lane_array + 2 * lane_array_64);
+    pattern->ticks = (uint32_t*)(block + 7 * lane_array + 2 * lane_array_64);
+    pattern->channel = (uint8_t*)(pattern->ticks + event_count);
+    pattern->commands = (MIDI_Command*)(pattern->channel + lane_count);
+    pattern->event_count = event_count;
+    pattern->track_count = track_count;
+    pattern->lane_count = lane_count;
+}
+
+/* Allocates the pattern block, the tracks are then written in order from first[track] and closed with midi_pattern_track_close */
+MIDI_INLINE int midi_pattern_alloc(MIDI_Pattern* pattern, const uint32_t track_count, const uint32_t event_count)
+{
+    uint8_t* block = calloc(1, midi_pattern_block_size(track_count, event_count));
+    if (block == NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern allocation failed\n" MIDI_COLOR_RESET);
+        return -1;
+    }
+    midi_pattern_bind(pattern, block, track_count, event_count);
+    return 0;
+}
+
+/* Stable bottom up merge sort of a track's events by tick, so chords keep their written order */
+MIDI_INLINE int midi_pattern_sort_events(uint32_t* ticks, MIDI_Command* commands, const uint32_t count)
+{
+    uint32_t* tick_buffer = (uint32_t*)malloc((size_t)count * sizeof(uint32_t));
+    MIDI_Command* command_buffer = (MIDI_Command*)malloc((size_t)count * sizeof(MIDI_Command));
+    if (tick_buffer == NULL || command_buffer == NULL)
+    {
+        free(tick_buffer);
+        free(command_buffer);
+        return -1;
+    }
+    uint32_t* tick_from = ticks;
+    MIDI_Command* command_from = commands;
+    uint32_t* tick_to = tick_buffer;
+    MIDI_Command* command_to = command_buffer;
+    for (uint64_t width = 1; width < count; width *= 2)
+    {
+        for (uint64_t left = 0; left < count; left += 2 * width)
+        {
+            const uint64_t middle = left + width < count ? left + width : count;
+            const uint64_t right = left + 2 * width < count ? left + 2 * width : count;
+            uint64_t i = left, j = middle, k = left;
+            while (i < middle && j < right)
+            {
+                const uint64_t from = tick_from[j] < tick_from[i] ? j++ : i++;
+                tick_to[k] = tick_from[from];
+                command_to[k++] = command_from[from];
+            }
+            for (; i < middle; ++i, ++k)
+            {
+                tick_to[k] = tick_from[i];
+                command_to[k] = command_from[i];
+            }
+            for (; j < right; ++j, ++k)
+            {
+                tick_to[k] = tick_from[j];
+                command_to[k] = command_from[j];
+            }
+        }
+        uint32_t* tick_swap = tick_from;
+        tick_from = tick_to;
+        tick_to = tick_swap;
+        MIDI_Command* command_swap = command_from;
+        command_from = command_to;
+        command_to = command_swap;
+    }
+    if (tick_from != ticks)
+    {
+        memcpy(ticks, tick_from, (size_t)count * sizeof(uint32_t));
+        memcpy(commands, command_from, (size_t)count * sizeof(MIDI_Command));
+    }
+    free(tick_buffer);
+    free(command_buffer);
+    return 0;
+}
+
+/* The track's events are written from first[track] up to end, puts them in tick order and starts the loop */
+MIDI_INLINE void midi_pattern_track_close(MIDI_Pattern* pattern, const uint32_t track, const uint32_t end, const uint32_t loop_ticks, const uint8_t channel)
+{
+    const uint32_t first = pattern->first[track];
+    pattern->position[track] = first;
+    pattern->wrap[track] = end;
+    if (end == first)
+    {
+        // loop of one step so the counter stays at 0 and never meets the next command
+        pattern->next_command[track] = UINT32_MAX;
+        return;
+    }
+    // a groove can move an event past its neighbours, keep the track in tick order. A single pass when the file is
+    // already in order, a merge sort otherwise, and insertion only if there's no memory left for that
+    uint32_t sorted = first + 1;
+    while (sorted < end && pattern->ticks[sorted - 1] <= pattern->ticks[sorted])
+        ++sorted;
+    if (sorted < end && midi_pattern_sort_events(pattern->ticks + first, pattern->commands + first, end - first) == 0)
+        sorted = end;
+    for (uint32_t j = sorted; j < end; ++j)
+    {
+        const uint32_t tick = pattern->ticks[j];
+        const MIDI_Command command = pattern->commands[j];
+        uint32_t k = j;
+        for (; k > first && pattern->ticks[k - 1] > tick; --k)
+        {
+            pattern->ticks[k] = pattern->ticks[k - 1];
+            pattern->commands[k] = pattern->commands[k - 1];
+        }
+        pattern->ticks[k] = tick;
+        pattern->commands[k] = command;
+    }
+    pattern->loop_steps[track] = loop_ticks - 1;
+    pattern->channel[track] = channel;
+    pattern->next_command[track] = pattern->ticks[first];
+    // an event placed past the loop end is never reached, so neither is the rest of the track
+    if (pattern->next_command[track] <= pattern->loop_steps[track])
+    {
+        pattern->due[track] = pattern->next_command[track];
+        pattern->heap[pattern->heap_size++] = track;
+    }
+}
+
+/* Once every track is closed, pads the lanes past track_count and builds the heap */
+MIDI_INLINE void midi_pattern_close(MIDI_Pattern* pattern)
+{
+    for (uint32_t i = pattern->track_count; i < pattern->lane_count; ++i)
+    {
+        pattern->first[i] = pattern->event_count;
+        midi_pattern_track_close(pattern, i, pattern->event_count, 1, 0);
+    }
+    for (uint32_t i = pattern->heap_size / 2; i-- > 0;)
+        midi_heap_sift_down(pattern, i);
+}
+
+/* Packs the parsed tracks into the pattern, one allocation for the events and the track state. The parsed
+ * tracks already sit one after the other so the events are copied in one go */
+MIDI_INLINE int midi_pattern_compile(MIDI_Pattern* pattern, const MIDI_Parsed_Pattern* parsed)
+{
+    if (parsed->track_count == 0)
+        return 0;
+    if (midi_pattern_alloc(pattern, parsed->track_count, parsed->count) != 0)
+        return -1;
+    pattern->bar_steps = parsed->bar_steps;
+
+    memcpy(pattern->ticks, parsed->ticks, (size_t)parsed->count * sizeof(uint32_t));
+    memcpy(pattern->commands, parsed->commands, (size_t)parsed->count * sizeof(MIDI_Command));
+    for (uint32_t i = 0; i < parsed->track_count; ++i)
+    {
+        const MIDI_Track_List* track = &parsed->tracks[i];
+        pattern->first[i] = track->first;
+        midi_pattern_track_close(pattern, i, track->first + track->count, track->loop_ticks, track->channel);
+    }
+    midi_pattern_close(pattern);
+    return 0;
+}
+
+MIDI_INLINE MIDI_Channels midi_channel_parse(const uint8_t channel)
+{
+    switch (channel)
+    {
+    case 1:
+        return MIDI_CHANNEL_1;
+    case 2:
+        return MIDI_CHANNEL_2;
+    case 3:
+        return MIDI_CHANNEL_3;
+    case 4:
+        return MIDI_CHANNEL_4;
+    case 5:
+        return MIDI_CHANNEL_5;
+    case 6:
+        return MIDI_CHANNEL_6;
+    case 7:
+        return MIDI_CHANNEL_7;
+    case 8:
+        return MIDI_CHANNEL_8;
+    case 9:
+        return MIDI_CHANNEL_9;
+    case 10:
+        return MIDI_CHANNEL_10;
+    case 11:
+        return MIDI_CHANNEL_11;
+    case 12:
+        return MIDI_CHANNEL_12;
+    case 13:
+        return MIDI_CHANNEL_13;
+    case 14:
+        return MIDI_CHANNEL_14;
+    case 15:
+        return MIDI_CHANNEL_15;
+    case 16:
+        return MIDI_CHANNEL_16;
+    default:
+        assert(0 && "ERROR - Invalid Channel parsed\n");
+        return MIDI_CHANNEL_UNDEFINED;
+    }
+}
+
+enum
+{
+    LINE_NOT_DEFINED = 0,
+    LINE_CHANNEL = 1,
+    LINE_LOOP = 2, //how many bars in the whole loop
+    LINE_SEQUENCE = 3
+};
+
+/* Placement is in beats from 1. Floored so 4.999 stays the last step of a bar, the epsilon keeps 1.1 * 480 from landing on 47 */
+MIDI_INLINE uint32_t midi_placement_to_step(const double placement, const uint32_t steps_per_beat)
+{
+    return (placement <= 1) ? 0 : (uint32_t)((placement - 1) * steps_per_beat + 1e-6);
+}
+
+/* Groove template, events landing exactly on the grid are moved by the offset of their grid position.
+ * Applied once when the file is parsed, the step engine only ever sees the moved ticks */
+#define MIDI_GROOVE_MAX_LENGTH 64
+typedef struct
+{
+    uint32_t grid_steps;  // steps per grid cell, 0 is no groove
+    uint32_t length;      // offsets repeat every length cells
+    int32_t offsets[MIDI_GROOVE_MAX_LENGTH]; // in steps
+} MIDI_Groove;
+
+/* Per track time signature and groove, set by the optional lines before the sequence */
+typedef struct
+{
+    uint8_t numerator;
+    uint8_t denominator;
+    uint32_t steps_per_beat; // ppqn * 4 / denominator
+    double loop_bars;
+    MIDI_Groove groove;
+} MIDI_Track_Format;
+
+MIDI_INLINE void midi_track_format_reset(MIDI_Track_Format* format, const uint32_t ppqn)
+{
+    memset(format, 0, sizeof(MIDI_Track_Format));
+    format->numerator = 4;
+    format->denominator = 4;
+    format->steps_per_beat = ppqn;
+}
+
+/* Single pass cursor over the text pattern, line and column are only worked out for error messages */
+typedef struct
+{
+    const char* at;
+    const char* end;
+    const char* line_start;
+    uint32_t line;
+} MIDI_Text_Scanner;
+
+MIDI_INLINE int midi_scan_error(const MIDI_Text_Scanner* scanner, const char* message)
+{
+    printf(MIDI_COLOR_RED "ERROR - line %u column %u: %s, check .midi file\n" MIDI_COLOR_RESET, scanner->line,
+           (uint32_t)(scanner->at - scanner->line_start) + 1, message);
+    return -1;
+}
+
+MIDI_INLINE void midi_scan_spaces(MIDI_Text_Scanner* scanner)
+{
+    while (scanner->at < scanner->end && (*scanner->at == ' ' || *scanner->at == '\t' || *scanner->at == '\r'))
+        ++scanner->at;
+}
+
+MIDI_INLINE int midi_scan_line_done(MIDI_Text_Scanner* scanner)
+{
+    midi_scan_spaces(scanner);
+    return scanner->at == scanner->end || *scanner->at == '\n';
+}
+
+MIDI_INLINE void midi_scan_next_line(MIDI_Text_Scanner* scanner)
+{
+    const char* newline = memchr(scanner->at, '\n', scanner->end - scanner->at);
+    scanner->at = newline ? newline + 1 : scanner->end;
+    scanner->line_start = scanner->at;
+    ++scanner->line;
+}
+
+/* Consumes word if the text continues with it */
+MIDI_INLINE int midi_scan_word(MIDI_Text_Scanner* scanner, const char* word)
+{
+    const size_t length = strlen(word);
+    if ((size_t)(scanner->end - scanner->at) < length || memcmp(scanner->at, word, length) != 0)
+        return 0;
+    scanner->at += length;
+    return 1;
+}
+
+MIDI_INLINE int midi_scan_char(MIDI_Text_Scanner* scanner, const char c)
+{
+    midi_scan_spaces(scanner);
+    if (scanner->at == scanner->end || *scanner->at != c)
+        return 0;
+    ++scanner->at;
+    return 1;
+}
+
+MIDI_INLINE int midi_scan_expect(MIDI_Text_Scanner* scanner, const char c)
+{
+    if (midi_scan_char(scanner, c))
+        return 0;
+    char message[16];
+    snprintf(message, sizeof(message), "expected '%c'", c);
+    return midi_scan_error(scanner, message);
+}
+
+/* Decimal number with an optional sign and fraction, always a '.' whatever the locale. Digits are gathered as an
+ * integer and divided once so "1.1" comes out as the same double strtod gives */
+MIDI_INLINE int midi_scan_number(MIDI_Text_Scanner* scanner, double* out)
+{
+    midi_scan_spaces(scanner);
+    const char* at = scanner->at;
+    const int negative = at < scanner->end && *at == '-';
+    if (at < scanner->end && (*at == '-' || *at == '+'))
+        ++at;
+    uint64_t mantissa = 0;
+    double scale = 1;
+    uint32_t digits = 0;
+    for (; at < scanner->end && *at >= '0' && *at <= '9'; ++at, ++digits)
+    {
+        if (mantissa < (1ULL << 53) / 10)
+            mantissa = mantissa * 10 + (uint64_t)(*at - '0');
+        else
+            scale /= 10; // past double precision, the digit only moves the decimal point
+    }
+    if (at < scanner->end && *at == '.')
+    {
+        for (++at; at < scanner->end && *at >= '0' && *at <= '9'; ++at, ++digits)
+        {
+            if (mantissa < (1ULL << 53) / 10)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*at - '0');
+                scale *= 10;
+            }
+        }
+    }
+    if (digits == 0)
+        return midi_scan_error(scanner, "expected a number");
+    *out = (negative ? -(double)mantissa : (double)mantissa) / scale;
+    scanner->at = at;
+    return 0;
+}
+
+MIDI_INLINE int midi_scan_hex(MIDI_Text_Scanner* scanner, uint8_t* out)
+{
+    midi_scan_spaces(scanner);
+    uint32_t value = 0;
+    const char* at = scanner->at;
+    for (; at < scanner->end && at - scanner->at < 2; ++at)
+    {
+        const char c = *at;
+        if (c >= '0' && c <= '9')
+            value = value * 16 + (uint32_t)(c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            value = value * 16 + (uint32_t)((c | 0x20) - 'a' + 10);
+        else
+            break;
+    }
+    if (at == scanner->at)
+        return midi_scan_error(scanner, "expected a hex byte");
+    *out = (uint8_t)value;
+    scanner->at = at;
+    return 0;
+}
+
+/* A data byte of #( the message doesn't use can be left empty and reads as 0, #(C9,04,,1) */
+MIDI_INLINE int midi_scan_data_hex(MIDI_Text_Scanner* scanner, uint8_t* out, const int unused)
+{
+    midi_scan_spaces(scanner);
+    if (unused && scanner->at < scanner->end && *scanner->at == ',')
+    {
+        *out = 0;
+        return 0;
+    }
+    return midi_scan_hex(scanner, out);
+}
+
+/* "time_signature: 7/8", the denominator has to divide the whole note into whole steps */
+MIDI_INLINE int midi_parse_time_signature(MIDI_Text_Scanner* scanner, const uint32_t ppqn, MIDI_Track_Format* format)
+{
+    double numerator = 0, denominator = 0;
+    if (midi_scan_number(scanner, &numerator) != 0 || !midi_scan_char(scanner, '/') || midi_scan_number(scanner, &denominator) != 0)
+        return midi_scan_error(scanner, "time signature parsed incorrectly");
+    const uint32_t whole_denominator = (uint32_t)denominator;
+    if (numerator < 1 || numerator > 255 || numerator != (uint32_t)numerator || denominator != whole_denominator || whole_denominator == 0 ||
+        (whole_denominator & (whole_denominator - 1)) != 0 || (ppqn * 4) % whole_denominator != 0)
+        return midi_scan_error(scanner, "time signature has to be a whole number over a power of two that fits the ppqn");
+    format->numerator = (uint8_t)numerator;
+    format->denominator = (uint8_t)whole_denominator;
+    format->steps_per_beat = ppqn * 4 / whole_denominator;
+    return 0;
+}
+
+/* "groove: swing16 62" or "swing8", the off beats move late by (percent - 50) / 50 of a grid cell, 50 is straight, 66.7 triplets.
+ * "groove: 16 0,0.2,0,-0.1" gives the offset of each 16th in fractions of a cell, "groove: none" clears it */
+MIDI_INLINE int midi_parse_groove(MIDI_Text_Scanner* scanner, const uint32_t ppqn, MIDI_Groove* groove)
+{
+    memset(groove, 0, sizeof(MIDI_Groove));
+    midi_scan_spaces(scanner);
+    if (midi_scan_word(scanner, "none"))
+        return 0;
+
+    const int swing = midi_scan_word(scanner, "swing");
+    double grid = 0, percent = 0;
+    if (midi_scan_number(scanner, &grid) != 0)
+        return -1;
+    if (grid < 1 || grid != (uint32_t)grid || (ppqn * 4) % (uint32_t)grid != 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - line %u: groove grid 1/%g doesn't fit %u ppqn\n" MIDI_COLOR_RESET, scanner->line, grid, ppqn);
+        return -1;
+    }
+    groove->grid_steps = ppqn * 4 / (uint32_t)grid;
+
+    if (swing)
+    {
+        if (midi_scan_number(scanner, &percent) != 0)
+            return -1;
+        if (percent < 50 || percent > 75)
+            return midi_scan_error(scanner, "swing outside 50 - 75");
+        groove->length = 2;
+        groove->offsets[1] = (int32_t)lround((percent - 50) / 50 * groove->grid_steps);
+        if (percent > 50 && groove->offsets[1] == 0)
+            printf(MIDI_COLOR_YELLOW "WARNING - swing smaller than one step at %u ppqn, raise ppqn to hear it\n" MIDI_COLOR_RESET, ppqn);
+        return 0;
+    }
+    do
+    {
+        double offset = 0;
+        if (midi_scan_number(scanner, &offset) != 0)
+            return -1;
+        if (groove->length == MIDI_GROOVE_MAX_LENGTH)
+            return midi_scan_error(scanner, "groove has too many offsets");
+        groove->offsets[groove->length++] = (int32_t)lround(offset * groove->grid_steps);
+    } while (midi_scan_char(scanner, ','));
+    return 0;
+}
+
+/* Placement to the step the event is launched on, grooved and wrapped into the loop */
+MIDI_INLINE uint32_t midi_track_step(const MIDI_Track_Format* format, const double placement, const uint32_t loop_ticks)
+{
+    const uint32_t step = midi_placement_to_step(placement, format->steps_per_beat);
+    const MIDI_Groove* groove = &format->groove;
+    if (groove->grid_steps == 0 || step % groove->grid_steps != 0 || step >= loop_ticks)
+        return step;
+    const int64_t moved = (int64_t)step + groove->offsets[(step / groove->grid_steps) % groove->length];
+    return (uint32_t)(((moved % loop_ticks) + loop_ticks) % loop_ticks);
+}
+
+/* Reads the text pattern into the parsed arrays, midi_parse_pattern compiles them into the pattern.
+ * One pass over text, there is no limit on line length and nothing is copied out of it */
+MIDI_INLINE int midi_parse_command_lists(const uint32_t ppqn, const char* text, const size_t length, MIDI_Parsed_Pattern* parsed)
+{
+    MIDI_Text_Scanner scanner = {text, text + length, text, 1};
+
+    int channel = -1;
+    uint8_t line = LINE_NOT_DEFINED;
+    MIDI_Track_Format format;
+    midi_track_format_reset(&format, ppqn);
+
+    for (; scanner.at < scanner.end; midi_scan_next_line(&scanner))
+    {
+        if (midi_scan_line_done(&scanner))
+            continue; // blank line
+        if (midi_scan_char(&scanner, '{'))
+        {
+            line = LINE_CHANNEL;
+            midi_track_format_reset(&format, ppqn);
+            continue;
+        }
+        else if (midi_scan_char(&scanner, '}'))
+        {
+            channel = -1;
+            line = LINE_NOT_DEFINED;
+            continue;
+        }
+
+        // optional track settings, anywhere between the channel and the sequence
+        if (line == LINE_LOOP || line == LINE_SEQUENCE)
+        {
+            if (midi_scan_word(&scanner, "time_signature:"))
+            {
+                if (midi_parse_time_signature(&scanner, ppqn, &format) != 0)
+                    return -1;
+                continue;
+            }
+            if (midi_scan_word(&scanner, "groove:"))
+            {
+                if (midi_parse_groove(&scanner, ppqn, &format.groove) != 0)
+                    return -1;
+                continue;
+            }
+        }
+
+        switch (line)
+        {
+        case LINE_CHANNEL:
+        {
+            double channel_parse = 0;
+            while (scanner.at < scanner.end && *scanner.at != ' ' && *scanner.at != '\t' && *scanner.at != '\n')
+                ++scanner.at; // the "CHANNEL:" label
+            if (midi_scan_number(&scanner, &channel_parse) != 0)
+                return -1;
+            if (channel_parse < 1 || channel_parse > 16 || channel_parse != (int)channel_parse)
+                return midi_scan_error(&scanner, "channel has to be 1 - 16");
+            channel = (int)channel_parse;
+            line = LINE_LOOP;
             DEBUG_PRINT("channel_parsed: %u\n", channel);
             break;
         }
-        case LINE_LOOP:
+        case LINE_LOOP:
+        {
+            double loop_parse = 0;
+            while (scanner.at < scanner.end && *scanner.at != ' ' && *scanner.at != '\t' && *scanner.at != '\n')
+                ++scanner.at; // the "loop_bars:" label
+            if (midi_scan_number(&scanner, &loop_parse) != 0)
+                return -1;
+            if (loop_parse <= 0)
+                return midi_scan_error(&scanner, "loop_bars has to be more than 0");
+            format.loop_bars = loop_parse; // turned into steps at the sequence, once the time signature is known
+            line = LINE_SEQUENCE;
+            break;
+        }
+        case LINE_SEQUENCE:
+        {
+            const uint32_t first = parsed->count;
+            uint8_t last_note = 0; // OFF(placement) releases the latest ON of the track
+
+            const double loop_steps = format.loop_bars * format.numerator * format.steps_per_beat + 0.5;
+            if (loop_steps >= UINT32_MAX)
+                return midi_scan_error(&scanner, "loop is longer than the sequencer's 32 bit steps");
+            const uint32_t loop_ticks = (uint32_t)loop_steps;
+            if (loop_ticks % format.steps_per_beat != 0)
+                printf(MIDI_COLOR_YELLOW "WARNING - loop is not beat aligned\n" MIDI_COLOR_RESET);
+            DEBUG_PRINT("loop_bars: %0.3f, %u/%u, loop_ticks: %u\n", format.loop_bars, format.numerator, format.denominator, loop_ticks);
+
+            while (!midi_scan_line_done(&scanner))
+            {
+                int result = 0;
+                uint8_t command_byte = 0, param1 = 0, param2 = 0;
+                double placement = 0;
+                if (midi_scan_word(&scanner, "ON("))
+                {
+                    double frequency = 0, velocity = 0;
+                    result = midi_scan_number(&scanner, &frequency) || midi_scan_expect(&scanner, ',') ||
+                             midi_scan_number(&scanner, &velocity) || midi_scan_expect(&scanner, ',') ||
+                             midi_scan_number(&scanner, &placement) || midi_scan_expect(&scanner, ')');
+                    command_byte = MIDI_NOTE_ON | midi_channel_parse((uint8_t)channel);
+                    param1 = last_note = midi_frequency_to_midi_note((float)frequency);
+                    param2 = velocity > 127 ? 127 : (velocity < 0 ? 0 : (uint8_t)velocity);
+                }
+                else if (midi_scan_word(&scanner, "OFF("))
+                {
+                    double value = 0, velocity = 0;
+                    result = midi_scan_number(&scanner, &value);
+                    command_byte = MIDI_NOTE_OFF | midi_channel_parse((uint8_t)channel);
+                    if (!result && midi_scan_char(&scanner, ','))
+                    {
+                        result = midi_scan_number(&scanner, &velocity) || midi_scan_expect(&scanner, ',') ||
+                                 midi_scan_number(&scanner, &placement);
+                        param1 = midi_frequency_to_midi_note((float)value);
+                        param2 = velocity > 127 ? 127 : (velocity < 0 ? 0 : (uint8_t)velocity);
+                    }
+                    else
+                    {
+                        placement = value;
+                        param1 = last_note;
+                    }
+                    result = result || midi_scan_expect(&scanner, ')');
+                }
+                else if (midi_scan_word(&scanner, "#("))
+                {
+                    result = midi_scan_hex(&scanner, &command_byte) || midi_scan_expect(&scanner, ',') ||
+                             midi_scan_data_hex(&scanner, &param1, midi_command_length(command_byte) < 2) || midi_scan_expect(&scanner, ',') ||
+                             midi_scan_data_hex(&scanner, &param2, midi_command_length(command_byte) < 3) || midi_scan_expect(&scanner, ',') ||
+                             midi_scan_number(&scanner, &placement) || midi_scan_expect(&scanner, ')');
+                }
+                else
+                    result = midi_scan_error(&scanner, "unknown command, expected ON(, OFF( or #(");
+                if (result == 0 && scanner.at < scanner.end && *scanner.at != ' ' && *scanner.at != '\t' && *scanner.at != '\r' && *scanner.at != '\n')
+                    result = midi_scan_error(&scanner, "expected a space between commands");
+                if (result != 0)
+                    return -1;
+
+                const uint32_t on_tick = midi_track_step(&format, placement, loop_ticks);
+                if (midi_parsed_push(parsed, on_tick, (MIDI_Command){command_byte, param1, param2}) != 0)
+                    return midi_scan_error(&scanner, "event allocation failed");
+                if (on_tick >= loop_ticks)
+                    printf(MIDI_COLOR_YELLOW "WARNING - line %u channel %d command placed after the end of the loop, it holds back the rest of the track\n" MIDI_COLOR_RESET,
+                           scanner.line, channel);
+                DEBUG_PRINT("Event - command: %u, param1: %u, param2: %u, on_tick: %u\n", command_byte, param1, param2, on_tick);
+            }
+            // every sequence line is its own track, a channel can have several with different loop lengths
+            if (parsed->count == first)
+                break;
+            if (midi_parsed_track_add(parsed, (MIDI_Track_List){first, parsed->count - first, loop_ticks, (uint8_t)(channel - 1)}) != 0)
+                return -1;
+            if (parsed->track_count == 1)
+                parsed->bar_steps = format.numerator * format.steps_per_beat;
+            break;
+        }
+        default:
+            break; // text outside the blocks is ignored
+        }
+    }
+    return 0;
+}
+
+/* Standard MIDI File import, type 0 and 1. The file is streamed through a fixed buffer and every track's events go
+ * into arrays that double as they fill, so there is no allocation per event */
+#define MIDI_SMF_READ_BUFFER 65536
+typedef struct
+{
+    FILE* file;
+    size_t position;
+    size_t length;
+    uint64_t consumed;     // bytes read so far, chunk ends are checked against it
+    int error;             // set on a read past the end of the file
+    uint8_t buffer[MIDI_SMF_READ_BUFFER];
+} MIDI_SMF_Reader;
+
+typedef struct
+{
+    uint32_t* ticks;       // already in sequencer steps
+    MIDI_Command* commands;
+    uint32_t count;
+    uint32_t capacity;
+    uint16_t channels;     // bit per channel used
+    uint8_t channel;       // first channel used, the track's channel in the pattern
+} MIDI_SMF_Track;
+
+MIDI_INLINE uint8_t midi_smf_byte(MIDI_SMF_Reader* reader)
+{
+    if (reader->position == reader->length)
+    {
+        reader->length = fread(reader->buffer, 1, MIDI_SMF_READ_BUFFER, reader->file);
+        reader->position = 0;
+        if (reader->length == 0)
+        {
+            reader->error = 1;
+            return 0;
+        }
+    }
+    ++reader->consumed;
+    return reader->buffer[reader->position++];
+}
+
+MIDI_INLINE uint32_t midi_smf_uint(MIDI_SMF_Reader* reader, const uint8_t bytes)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < bytes; ++i)
+        value = (value << 8) | midi_smf_byte(reader);
+    return value;
+}
+
+/* Variable length quantity, 7 bits a byte with the top bit set on all but the last, at most 4 bytes */
+MIDI_INLINE uint32_t midi_smf_vlq(MIDI_SMF_Reader* reader)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        const uint8_t byte = midi_smf_byte(reader);
+        value = (value << 7) | (byte & 0x7F);
+        if (!(byte & 0x80))
+            return value;
+    }
+    reader->error = 1;
+    return value;
+}
+
+MIDI_INLINE void midi_smf_skip(MIDI_SMF_Reader* reader, uint64_t bytes)
+{
+    while (bytes > 0 && !reader->error)
+    {
+        if (reader->position == reader->length)
+        {
+            --bytes;
+            midi_smf_byte(reader);
+            continue;
+        }
+        const size_t available = reader->length - reader->position;
+        const size_t step = bytes < available ? (size_t)bytes : available;
+        reader->position += step;
+        reader->consumed += step;
+        bytes -= step;
+    }
+}
+
+MIDI_INLINE int midi_smf_track_push(MIDI_SMF_Track* track, const uint32_t step, const MIDI_Command command)
+{
+    if (track->count == track->capacity)
+    {
+        const uint32_t capacity = track->capacity ? track->capacity * 2 : 1024;
+        uint32_t* ticks = (uint32_t*)realloc(track->ticks, capacity * sizeof(uint32_t));
+        if (ticks == NULL)
+            return -1;
+        track->ticks = ticks;
+        MIDI_Command* commands = (MIDI_Command*)realloc(track->commands, capacity * sizeof(MIDI_Command));
+        if (commands == NULL)
+            return -1;
+        track->commands = commands;
+        track->capacity = capacity;
+    }
+    const uint8_t channel = command.command_byte & MIDI_COMMAND_CHANNEL_BYTE_MASK;
+    if (track->channels == 0)
+        track->channel = channel;
+    track->channels |= (1<<channel);
+    track->ticks[track->count] = step;
+    track->commands[track->count++] = command;
+    return 0;
+}
+
+/* Reads one MTrk chunk, channel messages go into track, tempo changes onto the tempo map.
+ * The end step of the track is returned in end_step */
+MIDI_INLINE int midi_smf_read_track(MIDI_SMF_Reader* reader, const uint32_t division, const uint32_t ppqn, MIDI_SMF_Track* track,
+                                    MIDI_Tempo_Point** tempo_map, uint32_t* tempo_count, uint32_t* tempo_capacity,
+                                    uint8_t* numerator, uint8_t* denominator, uint64_t* end_step)
+{
+    const uint32_t length = midi_smf_uint(reader, 4);
+    const uint64_t chunk_end = reader->consumed + length;
+    uint64_t tick = 0;
+    uint8_t running_status = 0;
+    while (reader->consumed < chunk_end && !reader->error)
+    {
+        tick += midi_smf_vlq(reader);
+        const uint64_t step = (tick * ppqn + division / 2) / division;
+        if (step > UINT32_MAX)
+        {
+            printf(MIDI_COLOR_RED "ERROR - midi file is too long for the sequencer's 32 bit steps\n" MIDI_COLOR_RESET);
+            return -1;
+        }
+        uint8_t status = midi_smf_byte(reader);
+        if (status == 0xFF)
+        {
+            running_status = 0; // meta and sysex events cancel running status
+            const uint8_t type = midi_smf_byte(reader);
+            const uint32_t meta_length = midi_smf_vlq(reader);
+            if (type == 0x2F)
+            {
+                if (step > *end_step)
+                    *end_step = step; // the end of track can sit after the last note, the loop runs to it
+                midi_smf_skip(reader, chunk_end - reader->consumed); // anything after the end of track is ignored
+                break;
+            }
+            else if (type == 0x51 && meta_length == 3)
+            {
+                const uint32_t microseconds = midi_smf_uint(reader, 3);
+                if (microseconds == 0)
+                    continue;
+                if (*tempo_count == *tempo_capacity)
+                {
+                    *tempo_capacity = *tempo_capacity ? *tempo_capacity * 2 : 16;
+                    MIDI_Tempo_Point* grown = (MIDI_Tempo_Point*)realloc(*tempo_map, *tempo_capacity * sizeof(MIDI_Tempo_Point));
+                    if (grown == NULL)
+                        return -1;
+                    *tempo_map = grown;
+                }
+                (*tempo_map)[(*tempo_count)++] = (MIDI_Tempo_Point){(double)tick / division, 60000000.0f / microseconds, MIDI_TEMPO_JUMP};
+            }
+            else if (type == 0x58 && meta_length == 4 && *numerator == 0)
+            {
+                // the first time signature sets the bar the loop is rounded up to
+                *numerator = midi_smf_byte(reader);
+                const uint8_t power = midi_smf_byte(reader);
+                *denominator = power < 8 ? (uint8_t)(1 << power) : 0;
+                midi_smf_skip(reader, 2);
+            }
+            else
+                midi_smf_skip(reader, meta_length);
+            continue;
+        }
+        if (status == 0xF0 || status == 0xF7)
         {
-            float loop_parse = 0;
-            char tmp[50] = {0};
-            if (sscanf(buffer, "%s %f,", tmp, &loop_parse) != 2)
-                printf(MIDI_COLOR_YELLOW "WARNING: wrong amount of data parsed by channel %d - %f loop?" MIDI_COLOR_RESET, channel, loop_parse);
+            running_status = 0;
+            midi_smf_skip(reader, midi_smf_vlq(reader));
+            continue;
+        }
 
-            if (loop_parse > 0)
+        MIDI_Command command = {0, 0, 0};
+        if (status & 0x80)
+        {
+            if (status >= 0xF0)
             {
-                loop_ticks = loop_parse * MIDI_TICKS_PER_BAR;
-                line = LINE_SEQUENCE;
+                printf(MIDI_COLOR_RED "ERROR - midi file has a system message 0x%X inside a track\n" MIDI_COLOR_RESET, status);
+                return -1;
             }
-            else
+            running_status = status;
+            command.param1 = midi_smf_byte(reader);
+        }
+        else
+        {
+            if (running_status == 0)
             {
-                printf(MIDI_COLOR_RED "ERROR - channel %d loop parsed incorrectly, check .midi file. %s %f" MIDI_COLOR_RESET, channel, tmp, loop_parse);
+                printf(MIDI_COLOR_RED "ERROR - midi file data byte without a status\n" MIDI_COLOR_RESET);
                 return -1;
             }
-            if (loop_ticks % 24 != 0)
-                printf(MIDI_COLOR_YELLOW "WARNING - loop is not quater note aligned\n" MIDI_COLOR_RESET);
-
-            DEBUG_PRINT("loop_bars: %0.3, loop_ticks: %u\n", loop_parse, loop_ticks);
+            command.param1 = status; // running status, the byte read was the first data byte
+        }
+        command.command_byte = running_status;
+        if (midi_command_length(running_status) == 3)
+            command.param2 = midi_smf_byte(reader);
+        if (midi_smf_track_push(track, (uint32_t)step, command) != 0)
+        {
+            printf(MIDI_COLOR_RED "ERROR - midi file track allocation failed\n" MIDI_COLOR_RESET);
+            return -1;
+        }
+        if (step > *end_step)
+            *end_step = step;
+    }
+    if (reader->error)
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi file ends inside a track\n" MIDI_COLOR_RESET);
+        return -1;
+    }
+    return 0;
+}
 
+/* Reads a Standard MIDI File into a compiled pattern. Every track with channel messages becomes a sequencer track, all
+ * looping over the song rounded up to a whole bar of its first time signature. Tempo changes are returned in tempo_map */
+MIDI_INLINE int midi_smf_parse(FILE* file, const uint32_t ppqn, MIDI_Pattern* pattern, uint16_t* active_channels,
+                               MIDI_Tempo_Point** tempo_map, uint32_t* tempo_count)
+{
+    MIDI_SMF_Reader* reader = (MIDI_SMF_Reader*)malloc(sizeof(MIDI_SMF_Reader));
+    if (reader == NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi file reader allocation failed\n" MIDI_COLOR_RESET);
+        return -1;
+    }
+    memset(reader, 0, offsetof(MIDI_SMF_Reader, buffer));
+    reader->file = file;
+
+    int result = 0;
+    MIDI_SMF_Track* tracks = NULL;
+    uint32_t track_count = 0;
+    uint32_t tempo_capacity = 0;
+    uint8_t numerator = 0, denominator = 0;
+    uint64_t end_step = 0;
+
+    const uint32_t header_length = (midi_smf_skip(reader, 4), midi_smf_uint(reader, 4));
+    const uint16_t format = (uint16_t)midi_smf_uint(reader, 2);
+    const uint16_t chunk_count = (uint16_t)midi_smf_uint(reader, 2);
+    const uint16_t division = (uint16_t)midi_smf_uint(reader, 2);
+    if (reader->error || header_length < 6 || format > 1 || division == 0 || (division & 0x8000))
+    {
+        printf(MIDI_COLOR_RED "ERROR - only type 0 and 1 midi files timed in ticks per quater note are supported\n" MIDI_COLOR_RESET);
+        result = -1;
+    }
+    else
+        midi_smf_skip(reader, header_length - 6);
 
-            break;
+    if (result == 0 && chunk_count > 0)
+    {
+        tracks = (MIDI_SMF_Track*)calloc(chunk_count, sizeof(MIDI_SMF_Track));
+        if (tracks == NULL)
+            result = -1;
+    }
+    for (uint16_t chunk = 0; result == 0 && chunk < chunk_count; ++chunk)
+    {
+        const uint32_t id = midi_smf_uint(reader, 4);
+        if (reader->error)
+            break; // fewer chunks than the header says, keep what was read
+        if (id != 0x4D54726B) // "MTrk", anything else is skipped
+        {
+            midi_smf_skip(reader, midi_smf_uint(reader, 4));
+            continue;
         }
-        case LINE_SEQUENCE:
+        result = midi_smf_read_track(reader, division, ppqn, &tracks[track_count], tempo_map, tempo_count, &tempo_capacity,
+                                     &numerator, &denominator, &end_step);
+        if (tracks[track_count].count > 0)
+            ++track_count;
+    }
+
+    // tempo changes can sit on any track of a type 1 file, the map wants them in beat order
+    for (uint32_t i = 1; i < *tempo_count; ++i)
+    {
+        const MIDI_Tempo_Point point = (*tempo_map)[i];
+        uint32_t j = i;
+        for (; j > 0 && (*tempo_map)[j - 1].beat > point.beat; --j)
+            (*tempo_map)[j] = (*tempo_map)[j - 1];
+        (*tempo_map)[j] = point;
+    }
+
+    // one loop for every track so they stay in step, a whole number of bars long
+    uint32_t bar_steps = ppqn * 4;
+    if (numerator > 0 && denominator > 0 && (ppqn * 4) % denominator == 0)
+        bar_steps = numerator * (ppqn * 4 / denominator);
+    const uint64_t loop_ticks = end_step == 0 ? bar_steps : ((end_step + bar_steps - 1) / bar_steps) * bar_steps;
+    uint64_t event_count = 0;
+    for (uint32_t i = 0; i < track_count; ++i)
+        event_count += tracks[i].count;
+    if (result == 0 && (loop_ticks > UINT32_MAX || event_count > UINT32_MAX))
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi file is too big for the pattern\n" MIDI_COLOR_RESET);
+        result = -1;
+    }
+
+    if (result == 0 && track_count > 0)
+        result = midi_pattern_alloc(pattern, track_count, (uint32_t)event_count);
+    if (result == 0 && track_count > 0)
+    {
+        pattern->bar_steps = bar_steps;
+        uint32_t index = 0;
+        for (uint32_t i = 0; i < track_count; ++i)
         {
-            uint16_t node_count = 0;
-            if (channel < 1 || channel > 16)
+            pattern->first[i] = index;
+            for (uint32_t j = 0; j < tracks[i].count; ++j, ++index)
             {
-                printf(MIDI_COLOR_RED "ERROR - channel not know when parsing line sequences" MIDI_COLOR_RESET);
-                return -1;
+                // an event on the very end of a bar aligned song would never be reached, it goes on the last step
+                pattern->ticks[index] = tracks[i].ticks[j] < loop_ticks ? tracks[i].ticks[j] : (uint32_t)loop_ticks - 1;
+                pattern->commands[index] = tracks[i].commands[j];
             }
+            midi_pattern_track_close(pattern, i, index, (uint32_t)loop_ticks, tracks[i].channel);
+            *active_channels |= tracks[i].channels;
+        }
+        midi_pattern_close(pattern);
+        DEBUG_PRINT("midi file: type %u, %u tracks, %u events, loop of %u steps\n", format, track_count, (uint32_t)event_count, (uint32_t)loop_ticks);
+    }
 
-            Channel_Node* first_node = NULL;
+    for (uint32_t i = 0; i < chunk_count && tracks != NULL; ++i)
+    {
+        free(tracks[i].ticks);
+        free(tracks[i].commands);
+    }
+    free(tracks);
+    free(reader);
+    return result;
+}
 
+/* The image's track state is used as indices on the clock thread, so a stale or corrupt file is caught here.
+ * Returns what is wrong or NULL, O(tracks) */
+MIDI_INLINE const char* midi_pattern_image_check(const MIDI_Pattern* pattern)
+{
+    for (uint32_t track = 0; track < pattern->lane_count; ++track)
+    {
+        const uint32_t first = pattern->first[track], wrap = pattern->wrap[track];
+        if (track >= pattern->track_count || first == wrap)
+        {
+            // padding lanes and empty tracks must never launch
+            if (pattern->next_command[track] != UINT32_MAX)
+                return "has a track with no events that launches";
+            continue;
+        }
+        if (first > wrap || wrap > pattern->event_count)
+            return "has a track outside the events";
+        if (pattern->position[track] < first || pattern->position[track] >= wrap)
+            return "has a track position outside its events";
+    }
+    for (uint32_t i = 0; i < pattern->heap_size; ++i)
+    {
+        const uint32_t track = pattern->heap[i];
+        if (track >= pattern->track_count || pattern->first[track] == pattern->wrap[track])
+            return "has a scheduler heap entry that isn't a track";
+    }
+    return NULL;
+}
 
-            char* token = strtok(buffer, " ");
-            while (token != NULL)
-            {
-                if (node_count == 65535)
-                {
-                    printf(MIDI_COLOR_RED "ERROR - Maximum number of nodes hit\n" MIDI_COLOR_RESET);
-                    return -1;
-                }
-                ++node_count;
-                Channel_Node* next_node = NULL;
-                const uint8_t command = midi_get_command_sequence(token);
-                switch(command)
-                {
-                case MIDI_NOTE_ON:
-                {
-                    float frequency, placement;
-                    uint8_t velocity;
-                    sscanf(token, "ON(%f,%hhu,%f)", &frequency, &velocity, &placement);
-                    //printf("frequency: %f, velocity: %u, placement: %f\n", frequency, velocity, placement);
-
-                    const uint16_t on_tick = (placement <= 1) ? 0 : (placement - 1) * 24;
-                    next_node = midi_command_node(MIDI_NOTE_ON | midi_channel_parse((uint8_t)channel),
-                                                  midi_frequency_to_midi_note(frequency), velocity > 127 ? 127 : velocity,
-                                                  on_tick);
-                    break;
-                }
-                case MIDI_NOTE_OFF:
-                {
-                    float frequency, placement;
-                    uint8_t velocity;
-                    sscanf(token, "OFF(%f,%hhu,%f)", &frequency, &velocity, &placement);
-                    const uint16_t on_tick = (placement <= 1) ? 0 : (placement - 1) * 24;
-                    next_node = midi_command_node(MIDI_NOTE_OFF | midi_channel_parse((uint8_t)channel),
-                                                  midi_frequency_to_midi_note(frequency), velocity > 127 ? 127 : velocity,
-                                                  on_tick);
-                    break;
-                }
-                case MIDI_PARSE_DIRECT_HEX:
-                {
-                    float placement;
-                    uint8_t command, param1, param2;
-                    sscanf(token, "#(%hhx,%hhx,%hhx,%f)", &command, &param1, &param2, &placement);
-                    const uint16_t on_tick = (placement <= 1) ? 0 : (placement - 1) * 24;
-                    next_node = midi_command_node(command, param1, param2, on_tick);
-                    break;
+/* Maps a pattern image. Private and writable so the small per track state is copied on write, the events stay shared
+ * with the page cache. Nothing is allocated or parsed */
+MIDI_INLINE int midi_pattern_image_map(FILE* file, const uint32_t ppqn, MIDI_Pattern* pattern, uint16_t* active_channels)
+{
+    MIDI_Pattern_Image_Header header;
+    struct stat file_stat;
+    const char* problem = NULL;
+    if (fread(&header, 1, sizeof(header), file) != sizeof(header) || fstat(fileno(file), &file_stat) != 0)
+        problem = "is too short";
+    else if (header.version != MIDI_PATTERN_IMAGE_VERSION)
+        problem = "has an unsupported version";
+    else if (header.byte_order != MIDI_PATTERN_IMAGE_BYTE_ORDER)
+        problem = "was written on a machine with the other byte order";
+    else if (header.ppqn != ppqn)
+        problem = "was compiled for a different ppqn";
+    else if (header.header_size < sizeof(MIDI_Pattern_Image_Header) || header.header_size % 64 != 0 ||
+             header.block_size != (header.track_count ? midi_pattern_block_size(header.track_count, header.event_count) : 0) ||
+             header.header_size + header.block_size != (uint64_t)file_stat.st_size || header.heap_size > header.track_count)
+        problem = "sizes don't match the file";
+    if (problem != NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern image %s\n" MIDI_COLOR_RESET, problem);
+        return -1;
+    }
+    *active_channels = header.active_channels;
+    if (header.track_count == 0)
+        return 0;
 
-                }
-                case MIDI_COMMAND_INVALID:
-                    printf(MIDI_COLOR_RED "ERROR - invalid command parsed" MIDI_COLOR_RESET);
-                    return -1;
-                }
+    const size_t size = (size_t)file_stat.st_size;
+    uint8_t* mapping = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fileno(file), 0);
+    if (mapping == MAP_FAILED)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern image mmap failed: %s\n" MIDI_COLOR_RESET, strerror(errno));
+        *active_channels = 0;
+        return -1;
+    }
+    midi_pattern_bind(pattern, mapping + header.header_size, header.track_count, header.event_count);
+    pattern->heap_size = header.heap_size;
+    pattern->bar_steps = header.bar_steps;
+    pattern->mapping = mapping;
+    pattern->mapping_size = size;
+    problem = midi_pattern_image_check(pattern);
+    if (problem != NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern image %s\n" MIDI_COLOR_RESET, problem);
+        midi_pattern_free(pattern);
+        *active_channels = 0;
+        return -1;
+    }
+    // take the copy on write faults on the track state now rather than on the first step
+    for (uint8_t* page = mapping; page < (uint8_t*)pattern->ticks; page += 4096)
+        *(volatile uint8_t*)page = *(volatile uint8_t*)page;
+    DEBUG_PRINT("pattern image: %u tracks, %u events mapped\n", header.track_count, header.event_count);
+    return 0;
+}
 
-                DEBUG_PRINT("Node - command: %u, param1: %u, param2: %u, on_tick: %u\n",
-                            next_node->command.command_byte,
-                            next_node->command.param1,
-                            next_node->command.param2,
-                            next_node->on_tick);
+/* Parses filepath straight into a compiled pattern, touches nothing shared so it can run while the sequencer plays */
+MIDI_INLINE int midi_parse_pattern(const char* filepath, const uint32_t ppqn, MIDI_Pattern* pattern, uint16_t* active_channels,
+                                   MIDI_Tempo_Point** tempo_map, uint32_t* tempo_count)
+{
+    memset(pattern, 0, sizeof(MIDI_Pattern));
+    *active_channels = 0;
+    *tempo_map = NULL;
+    *tempo_count = 0;
+    FILE* file = fopen(filepath, "rb");
+    if (file == 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi commands file cannot be opened\n" MIDI_COLOR_RESET);
+        return -1;
+    }
 
-                if (first_node == NULL)
-                {
-                    first_node = next_node;
-                    controller->midi_commands.next_command[channel -1] = first_node->on_tick;
-                }
-                else
+    // pattern images and standard midi files are told apart from the text format by their header
+    char magic[8] = {0};
+    const size_t magic_length = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    if (magic_length == sizeof(magic) && memcmp(magic, MIDI_PATTERN_IMAGE_MAGIC, sizeof(MIDI_PATTERN_IMAGE_MAGIC)) == 0)
+    {
+        const int result = midi_pattern_image_map(file, ppqn, pattern, active_channels);
+        fclose(file); // the mapping stays valid
+        return result;
+    }
+    if (magic_length >= 4 && memcmp(magic, "MThd", 4) == 0)
+    {
+        int result = midi_smf_parse(file, ppqn, pattern, active_channels, tempo_map, tempo_count);
+        fclose(file);
+        if (result != 0)
+        {
+            midi_pattern_free(pattern);
+            *active_channels = 0;
+        }
+        return result;
+    }
+
+    // the text is scanned straight out of the page cache
+    struct stat file_stat;
+    if (fstat(fileno(file), &file_stat) != 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi commands file cannot be read\n" MIDI_COLOR_RESET);
+        fclose(file);
+        return -1;
+    }
+    const size_t length = (size_t)file_stat.st_size;
+    const char* text = length ? (const char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0) : "";
+    fclose(file);
+    if (text == MAP_FAILED)
+    {
+        printf(MIDI_COLOR_RED "ERROR - midi commands file mmap failed: %s\n" MIDI_COLOR_RESET, strerror(errno));
+        return -1;
+    }
+
+    MIDI_Parsed_Pattern parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    int result = midi_parse_command_lists(ppqn, text, length, &parsed);
+    if (length)
+        munmap((void*)text, length);
+
+    if (result == 0)
+        result = midi_pattern_compile(pattern, &parsed);
+    if (result == 0)
+    {
+        for (uint32_t i = 0; i < parsed.track_count; ++i)
+            *active_channels |= (1<<parsed.tracks[i].channel);
+    }
+    midi_parsed_free(&parsed); // only needed to build the pattern
+    return result;
+}
+
+MIDI_INLINE int midi_pattern_image_write(const char* filepath, const char* image_path, const uint32_t ppqn)
+{
+    MIDI_Pattern pattern;
+    uint16_t active_channels;
+    MIDI_Tempo_Point* tempo_map;
+    uint32_t tempo_count;
+    int result = midi_parse_pattern(filepath, ppqn, &pattern, &active_channels, &tempo_map, &tempo_count);
+    free(tempo_map);
+    if (result != 0)
+    {
+        midi_pattern_free(&pattern);
+        return -1;
+    }
+
+    MIDI_Pattern_Image_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MIDI_PATTERN_IMAGE_MAGIC, sizeof(MIDI_PATTERN_IMAGE_MAGIC));
+    header.version = MIDI_PATTERN_IMAGE_VERSION;
+    header.byte_order = MIDI_PATTERN_IMAGE_BYTE_ORDER;
+    header.header_size = sizeof(MIDI_Pattern_Image_Header);
+    header.ppqn = ppqn;
+    header.track_count = pattern.track_count;
+    header.event_count = pattern.event_count;
+    header.heap_size = pattern.heap_size;
+    header.active_channels = active_channels;
+    header.block_size = pattern.track_count ? midi_pattern_block_size(pattern.track_count, pattern.event_count) : 0;
+    header.bar_steps = pattern.bar_steps;
+
+    FILE* file = fopen(image_path, "wb");
+    if (file == NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern image %s cannot be opened\n" MIDI_COLOR_RESET, image_path);
+        midi_pattern_free(&pattern);
+        return -1;
+    }
+    // a freshly compiled block is the state the sequencer starts from, so it is written as is
+    if (fwrite(&header, 1, sizeof(header), file) != sizeof(header) ||
+        fwrite(pattern.loop_steps, 1, header.block_size, file) != header.block_size)
+        result = -1;
+    if (fclose(file) != 0 || result != 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern image %s couldn't be written\n" MIDI_COLOR_RESET, image_path);
+        result = -1;
+    }
+    midi_pattern_free(&pattern);
+    return result;
+}
+
+MIDI_INLINE int midi_parse_commands(MIDI_Controller* controller, const char* filepath)
+{
+    MIDI_Tempo_Point* tempo_map;
+    uint32_t tempo_count;
+    const int result = midi_parse_pattern(filepath, controller->midi_commands.ppqn, &controller->midi_commands.pattern, &controller->active_channels,
+                                          &tempo_map, &tempo_count);
+    // the file's tempo changes drive the master clock
+    if (result == 0 && tempo_count > 0)
+        midi_tempo_map_set(controller, tempo_map, tempo_count);
+    free(tempo_map);
+    return result;
+}
+
+/* Stands in for the step engine while a swap is pending, counts down to the boundary and swaps on the step it lands on */
+static void midi_step_tracks_swap(MIDI_Controller* controller)
+{
+    Input_Controller* input_controller = &controller->midi_commands;
+    if (input_controller->swap_countdown > 0)
+    {
+        --input_controller->swap_countdown;
+        input_controller->swap_step_tracks(controller);
+        return;
+    }
+    // readers only get at the pattern with the mutex held, so once copied out nothing holds the old one
+    input_controller->retired_pattern = input_controller->pattern;
+    input_controller->pattern = input_controller->next_pattern;
+    memset(&input_controller->next_pattern, 0, sizeof(MIDI_Pattern));
+    controller->active_channels = input_controller->next_active_channels;
+    input_controller->pattern_start = input_controller->next_pattern_start;
+    input_controller->step_tracks = input_controller->swap_step_tracks;
+    input_controller->step_tracks(controller);
+}
+
+/* Steps the engine has run since setup. Must be called with the controller mutex held */
+MIDI_INLINE uint64_t midi_steps_run_locked(MIDI_Controller* controller)
+{
+    const uint32_t steps_per_clock = controller->midi_commands.steps_per_clock;
+    // the step that sent the last midi clock was the first of its steps_per_clock
+    uint64_t steps = (uint64_t)atomic_load_explicit(&controller->tick_count, memory_order_relaxed) * steps_per_clock;
+    if (controller->clock_step != 0)
+        steps -= steps_per_clock - controller->clock_step;
+    return steps - controller->pending_steps;
+}
+
+MIDI_INLINE int midi_pattern_load(MIDI_Controller* controller, const char* filepath, const uint32_t bars)
+{
+    // ppqn is fixed at setup, the rest of the work is done before taking the lock
+    MIDI_Pattern pattern;
+    uint16_t active_channels;
+    MIDI_Tempo_Point* tempo_map;
+    uint32_t tempo_count;
+    const int result = midi_parse_pattern(filepath, controller->midi_commands.ppqn, &pattern, &active_channels, &tempo_map, &tempo_count);
+    free(tempo_map); // a swapped in midi file keeps the running tempo
+    if (result != 0)
+    {
+        midi_pattern_free(&pattern);
+        return -1;
+    }
+
+    Input_Controller* input_controller = &controller->midi_commands;
+    pthread_mutex_lock(&controller->mutex);
+    if (input_controller->step_tracks == midi_step_tracks_swap)
+    {
+        pthread_mutex_unlock(&controller->mutex);
+        printf(MIDI_COLOR_YELLOW "WARNING - pattern swap still pending, load ignored\n" MIDI_COLOR_RESET);
+        midi_pattern_free(&pattern);
+        return -1;
+    }
+    MIDI_Pattern retired = input_controller->retired_pattern;
+    memset(&input_controller->retired_pattern, 0, sizeof(MIDI_Pattern));
+
+    // bars of the playing pattern, counted from the step it came in on, so a 7/8 set swaps on its own downbeat
+    const MIDI_Pattern* playing = &input_controller->pattern;
+    const uint32_t bar_steps = playing->bar_steps ? playing->bar_steps : input_controller->ppqn * 4;
+    const uint64_t boundary = (uint64_t)(bars ? bars : 1) * bar_steps;
+    const uint64_t steps_run = midi_steps_run_locked(controller);
+    const uint64_t into_bar = (steps_run - input_controller->pattern_start) % boundary;
+    input_controller->swap_countdown = into_bar ? boundary - into_bar : 0;
+    input_controller->next_pattern_start = steps_run + input_controller->swap_countdown;
+    input_controller->next_pattern = pattern;
+    input_controller->next_active_channels = active_channels;
+    input_controller->swap_step_tracks = input_controller->step_tracks;
+    input_controller->step_tracks = midi_step_tracks_swap;
+    pthread_mutex_unlock(&controller->mutex);
+
+    midi_pattern_free(&retired); // swapped out by an earlier load, no step has read it since
+    return 0;
+}
+
+MIDI_INLINE int midi_pattern_swap_pending(MIDI_Controller* controller)
+{
+    pthread_mutex_lock(&controller->mutex);
+    const int pending = controller->midi_commands.step_tracks == midi_step_tracks_swap;
+    pthread_mutex_unlock(&controller->mutex);
+    return pending;
+}
+
+/* Counts a midi clock tick and sends it extern. Must be called with the controller mutex held */
+MIDI_INLINE void midi_clock_pulse_locked(MIDI_Controller* controller)
+{
+    // only writer is under the mutex, so a plain load and store is enough
+    atomic_store_explicit(&controller->tick_count, atomic_load_explicit(&controller->tick_count, memory_order_relaxed) + 1, memory_order_release);
+    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
+    {
+        const MIDI_Command command = {MIDI_SYSTEM_MESSAGE | MIDI_CLOCK, 0, 0};
+        midi_sequenced_write_locked(controller, &command, 1);
+    }
+}
+
+/* Runs the step engine for steps sequencer steps, inline or on the midi thread. Must be called with the controller mutex held */
+MIDI_INLINE void midi_sequencer_advance_locked(MIDI_Controller* controller, const uint32_t steps)
+{
+    if (controller->flags & MIDI_TICK_INLINE)
+    {
+        for (uint32_t i = 0; i < steps; ++i)
+            midi_increment_step_count_simd(controller);
+        return;
+    }
+    controller->pending_steps += steps;
+    controller->flags |= MIDI_CLOCK_COMMAND_SENT;
+    pthread_cond_signal(&controller->cond);
+}
+
+/* A 24 PPQN clock tick from the app or the external input, moves the sequencer on by ppqn/24 steps. Must be called with the controller mutex held */
+MIDI_INLINE void midi_clock_tick_locked(MIDI_Controller* controller, const uint64_t timestamp_ns)
+{
+    controller->tick_timestamp_ns = timestamp_ns;
+    midi_clock_pulse_locked(controller);
+    midi_sequencer_advance_locked(controller, controller->midi_commands.steps_per_clock);
+}
+
+/* Moves past steps that midi_steps_until_next_event_locked said have nothing due and no midi clock. Must be called with the controller mutex held */
+MIDI_INLINE void midi_clock_skip_locked(MIDI_Controller* controller, const uint32_t steps)
+{
+    if (steps == 0)
+        return;
+    controller->clock_step = (controller->clock_step + steps) % controller->midi_commands.steps_per_clock;
+    if (controller->flags & MIDI_TICK_INLINE)
+    {
+        if (controller->midi_commands.step_tracks == midi_step_tracks_heap)
+            controller->midi_commands.pattern.step += steps;
+        else // a swap was queued while the clock slept, it has to count these
+            midi_sequencer_advance_locked(controller, steps);
+    }
+    else
+        controller->pending_steps += steps; // no wake up, the midi thread runs them with the next step
+}
+
+/* One internal clock step at the full ppqn, the midi clock goes out on every ppqn/24th step. Must be called with the controller mutex held */
+MIDI_INLINE void midi_clock_step_locked(MIDI_Controller* controller, const uint64_t timestamp_ns)
+{
+    controller->tick_timestamp_ns = timestamp_ns;
+    if (controller->clock_step == 0)
+        midi_clock_pulse_locked(controller);
+    if (++controller->clock_step == controller->midi_commands.steps_per_clock)
+        controller->clock_step = 0;
+    midi_sequencer_advance_locked(controller, 1);
+}
+
+/* Sets the transport state and sends the start/stop/continue byte extern. Must be called with the controller mutex held */
+MIDI_INLINE void midi_transport_set_locked(MIDI_Controller* controller, const MIDI_Transport state, const uint8_t system_message)
+{
+    atomic_store_explicit(&controller->transport, state, memory_order_release);
+    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
+    {
+        uint8_t command = MIDI_SYSTEM_MESSAGE | system_message;
+        write(controller->midi_external_output, &command, sizeof(uint8_t));
+    }
+}
+
+/* Queues the command and sends it extern. Must be called with the controller mutex held.
+ * A rejected command isn't sent extern either, so a retry doesn't play it twice */
+MIDI_INLINE int midi_message_send_locked(MIDI_Controller* controller, const MIDI_Command command, const uint64_t timestamp_ns)
+{
+    if (midi_event_push(controller, command, timestamp_ns) == MIDI_QUEUE_FULL)
+        return MIDI_QUEUE_FULL;
+    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
+        write(controller->midi_external_output, &command, midi_command_length(command.command_byte));
+    return 0;
+}
+
+#define MSB_MASK (1<<7)
+/* Byte stream parser for the external input, keeps running status and partial messages between reads */
+typedef struct
+{
+    uint8_t status;     // running status, 0 when waiting for a status byte
+    uint8_t data[2];
+    uint8_t data_count;
+    uint8_t expected;   // data bytes the current status needs
+} MIDI_Input_Parser;
+
+#define MIDI_SYSEX_START 0xF0
+#define MIDI_SYSEX_END   0xF7
+#define MIDI_REALTIME_FIRST 0xF8
+
+/* Feeds one byte into the parser. Returns 1 and fills out_command when a message is complete */
+MIDI_INLINE int midi_input_parse_byte(MIDI_Input_Parser* parser, const uint8_t byte, MIDI_Command* out_command)
+{
+    if (byte >= MIDI_REALTIME_FIRST) // real time messages can arrive in the middle of others and don't touch running status
+    {
+        *out_command = (MIDI_Command){byte, 0, 0};
+        return 1;
+    }
+    if (byte & MSB_MASK)
+    {
+        parser->data_count = 0;
+        if (byte == MIDI_SYSEX_END)
+        {
+            parser->status = 0;
+            return 0;
+        }
+        parser->status = byte;
+        parser->expected = (byte == MIDI_SYSEX_START) ? 0 : midi_command_length(byte) - 1;
+        if (parser->expected == 0 && byte != MIDI_SYSEX_START)
+        {
+            parser->status = 0;
+            *out_command = (MIDI_Command){byte, 0, 0};
+            return 1;
+        }
+        return 0;
+    }
+    if (parser->status == 0 || parser->status == MIDI_SYSEX_START) // stray data or system exclusive payload
+        return 0;
+
+    parser->data[parser->data_count++] = byte;
+    if (parser->data_count < parser->expected)
+        return 0;
+
+    *out_command = (MIDI_Command){parser->status, parser->data[0], parser->expected == 2 ? parser->data[1] : 0};
+    parser->data_count = 0;
+    if (parser->status >= MIDI_SYSTEM_MESSAGE) // system common messages cancel running status
+        parser->status = 0;
+    return 1;
+}
+
+/* Queues and forwards the thru commands collected from one read, with one lock and one write.
+ * System messages are only forwarded, the queue holds channel messages */
+MIDI_INLINE void midi_input_flush_through(MIDI_Controller* controller, const MIDI_Command* commands, const uint32_t count, const uint64_t timestamp_ns)
+{
+    if (count == 0)
+        return;
+    pthread_mutex_lock(&controller->mutex);
+    for (uint32_t i = 0; i < count; ++i)
+        if ((commands[i].command_byte & MIDI_COMMAND_TYPE_BYTE_MASK) != MIDI_SYSTEM_MESSAGE)
+            midi_event_push(controller, commands[i], timestamp_ns);
+    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
+        midi_message_write_batch(controller, commands, count);
+    pthread_mutex_unlock(&controller->mutex);
+}
+
+MIDI_INLINE void* midi_external_input_thread(void* args)
+{
+    MIDI_Controller* controller = (MIDI_Controller*)args;
+    int midi_external_input = controller->midi_external_input;
+
+    MIDI_Input_Parser parser = {0};
+    uint8_t buffer[256] = {0};
+    MIDI_Command through[256]; // a message needs at least one byte so a read can't produce more than this
+
+    // sleeps in poll until the device has data or destroy writes the shutdown event, no polling interval
+    struct pollfd fds[2] = {{midi_external_input, POLLIN, 0}, {controller->shutdown_event, POLLIN, 0}};
+    while(1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf(MIDI_COLOR_RED "ERROR - poll on MIDI external input failed: %d\n" MIDI_COLOR_RESET, errno);
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            break;
+
+        if (fds[0].revents & POLLIN)
+        {
+            ssize_t bytes_read;
+            while ((bytes_read = read(midi_external_input, buffer, sizeof(buffer))) > 0)
+            {
+                const uint64_t timestamp_ns = midi_time_now_ns();
+                DEBUG_PRINT("Bytes read %ld\n", bytes_read);
+                uint32_t through_count = 0;
+                for (ssize_t i = 0; i < bytes_read; ++i)
                 {
-                    int check = midi_place_next_node(first_node, next_node);
-                    if (check == LOOP_SAFETY_TRIGGERED)
+                    MIDI_Command command;
+                    if (!midi_input_parse_byte(&parser, buffer[i], &command))
+                        continue;
+
+                    if (command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_CLOCK))
                     {
-                        assert(0 && "ERROR - LOOP_SAFETY_TRIGGERED\n");
+                        if (controller->clock_mode == MIDI_CLOCK_MODE_EXTERNAL)
+                        {
+                            // keep the order the bytes arrived in on the output
+                            midi_input_flush_through(controller, through, through_count, timestamp_ns);
+                            through_count = 0;
+                            pthread_mutex_lock(&controller->mutex);
+                            midi_clock_tick_locked(controller, timestamp_ns);
+                            pthread_mutex_unlock(&controller->mutex);
+                        }
                     }
-                    else if (check != 0)
+                    else if (controller->clock_mode == MIDI_CLOCK_MODE_EXTERNAL &&
+                             (command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_START) ||
+                              command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_CONTINUE) ||
+                              command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_STOP)))
                     {
-                        printf(MIDI_COLOR_RED "ERROR - couldn't find next free node\n" MIDI_COLOR_RESET);
+                        midi_input_flush_through(controller, through, through_count, timestamp_ns);
+                        through_count = 0;
+                        pthread_mutex_lock(&controller->mutex);
+                        midi_transport_set_locked(controller, command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_STOP) ? MIDI_TRANSPORT_STOPPED : MIDI_TRANSPORT_PLAYING,
+                                                  command.command_byte & MIDI_COMMAND_CHANNEL_BYTE_MASK);
+                        pthread_mutex_unlock(&controller->mutex);
                     }
+                    else if (controller->flags & MIDI_EXTERNAL_THROUGH)
+                        through[through_count++] = command;
                 }
-                token = strtok(NULL, " ");
+                midi_input_flush_through(controller, through, through_count, timestamp_ns);
             }
-            //complete the loop and initalize the channel settings
-            int check = midi_place_next_node(first_node, first_node);
-            if (check == LOOP_SAFETY_TRIGGERED)
+            // 0 is end of file, a pty whose other side closed fails with EIO, either way nothing more will come
+            if (bytes_read == 0 || (errno != EAGAIN && errno != EINTR))
             {
-                assert(0 && "ERROR - LOOP_SAFETY_TRIGGERED\n");
-                printf(MIDI_COLOR_YELLOW "WARNING - loop saftey triggered\n" MIDI_COLOR_RESET);
+                printf(MIDI_COLOR_YELLOW "WARNING - MIDI external input disconnected\n" MIDI_COLOR_RESET);
+                break;
             }
-            else if (check != 0)
+        }
+        // a hangup can come with POLLIN for the last bytes, those were read above
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+        {
+            printf(MIDI_COLOR_YELLOW "WARNING - MIDI external input disconnected\n" MIDI_COLOR_RESET);
+            break;
+        }
+    }
+
+    DEBUG_PRINT("MIDI external input thread exiting\n", "");
+
+    return NULL;
+}
+
+/* Sleeps until spin_ns before the deadline then spins the rest, the wake up latency of the sleep is covered by the spin.
+ * Returns -1 if destroy woke it */
+MIDI_INLINE int midi_sender_wait_until(MIDI_Controller* controller, const uint64_t deadline_ns)
+{
+    if (deadline_ns > midi_time_now_ns() + controller->sender_spin_ns)
+    {
+        const struct timespec wake = midi_ns_to_timespec(deadline_ns - controller->sender_spin_ns);
+        pthread_mutex_lock(&controller->mutex);
+        int result = 0;
+        while (!(controller->flags & MIDI_INTERFACE_DESTORY) && result != ETIMEDOUT)
+        {
+            result = pthread_cond_timedwait(&controller->send_cond, &controller->mutex, &wake);
+            if (result != 0 && result != ETIMEDOUT)
             {
-                printf(MIDI_COLOR_RED "ERROR - couldn't find next free node\n" MIDI_COLOR_RESET);
+                DEBUG_PRINT("WARNING - pthread_cond_timedwait failed: %d\n", result);
+                break;
             }
-            controller->midi_commands.node_count[channel -1] = node_count;
-            controller->midi_commands.loop_steps[channel -1] = loop_ticks;
-            controller->midi_commands.channel[channel -1] = first_node;
-            controller->active_channels |= (1<<(channel -1));
-            break;
-        }
         }
+        const int destroy = controller->flags & MIDI_INTERFACE_DESTORY;
+        pthread_mutex_unlock(&controller->mutex);
+        if (destroy)
+            return -1;
     }
+    while (midi_time_now_ns() < deadline_ns)
+        MIDI_CPU_RELAX();
     return 0;
 }
 
-#define MSB_MASK (1<<7)
-MIDI_INLINE void* midi_external_input_thread(void* args)
+/* Writes the lookahead output extern at its deadlines, everything due at once goes out in one writev */
+MIDI_INLINE void* midi_sender_thread_loop(void* arg)
 {
-    MIDI_Controller* controller = (MIDI_Controller*)args;
-    int midi_external_input = controller->midi_external_input;
-
-
-    uint8_t buffer[60] = {0}; // for place for 20 inputs
+    MIDI_Controller* controller = (MIDI_Controller*)arg;
+    MIDI_Outbound_Queue* outbound = &controller->outbound;
+    struct iovec iov[MIDI_BATCH_IOV_MAX];
+    uint32_t tail = atomic_load_explicit(&outbound->tail, memory_order_relaxed);
 
-    while(1)
+    while (1)
     {
-        ssize_t bytes_read = read(midi_external_input, buffer, sizeof(buffer));
-
-        if (bytes_read > 0)
+        const uint32_t head = atomic_load_explicit(&outbound->head, memory_order_acquire);
+        if (head == tail)
         {
-            DEBUG_PRINT("Bytes read %ld\n", bytes_read);
-            for (uint8_t i = 0; i < bytes_read; ++i)
-            {
-                if (buffer[i] == (MIDI_SYSTEM_MESSAGE | MIDI_CLOCK))
-                {
-                    if (controller->clock_mode == MIDI_CLOCK_MODE_EXTERNAL)
-                        midi_command_clock(controller);
-                }
-                else if (controller->flags & MIDI_EXTERNAL_THROUGH)
-                {
-                    uint8_t command = buffer[i];
-                    uint8_t param1 = 0, param2 = 0;
-                    if ((i +1 < bytes_read) && !(buffer[i+1] & MSB_MASK))
-                    {
-                        param1 = buffer[++i];
-                        if((i +1 < bytes_read) && !(buffer[i+1] & MSB_MASK))
-                            param2 = buffer[++i];
-                    }
-                    midi_message_send(controller, command, param1, param2);
-                }
-            }
-            usleep(500);
+            pthread_mutex_lock(&controller->mutex);
+            outbound->sender_waiting = 1;
+            while (!(controller->flags & MIDI_INTERFACE_DESTORY) && atomic_load_explicit(&outbound->head, memory_order_relaxed) == tail)
+                pthread_cond_wait(&controller->send_cond, &controller->mutex);
+            outbound->sender_waiting = 0;
+            const int destroy = controller->flags & MIDI_INTERFACE_DESTORY;
+            pthread_mutex_unlock(&controller->mutex);
+            if (destroy)
+                break;
+            continue;
         }
-        else
-            usleep(1000);
 
-        pthread_mutex_lock(&controller->mutex);
-        if(controller->flags & MIDI_INTERFACE_DESTORY)
-        {
-            pthread_mutex_unlock(&controller->mutex);
+        if (midi_sender_wait_until(controller, outbound->buffer[tail & outbound->mask].deadline_ns) != 0)
             break;
+
+        const uint64_t now = midi_time_now_ns();
+        uint32_t count = 0;
+        while (tail != head && count < MIDI_BATCH_IOV_MAX && outbound->buffer[tail & outbound->mask].deadline_ns <= now)
+        {
+            const MIDI_Outbound_Event* event = &outbound->buffer[tail & outbound->mask];
+            iov[count].iov_base = (void*)&event->command;
+            iov[count].iov_len = midi_command_length(event->command.command_byte);
+            ++count;
+            ++tail;
         }
-        pthread_mutex_unlock(&controller->mutex);
+        if (writev(controller->midi_external_output, iov, count) < 0)
+        {
+            DEBUG_PRINT("WARNING - writev to external output failed: %d\n", errno);
+        }
+        atomic_store_explicit(&outbound->tail, tail, memory_order_release); // the slots are only handed back once written
     }
 
-
-    DEBUG_PRINT("MIDI external input thread exiting\n", "");
+    DEBUG_PRINT("MIDI sender thread exiting\n", "");
 
     return NULL;
 }
@@ -727,33 +3070,84 @@ MIDI_INLINE void* midi_external_input_thread(void* args)
 #define MIDI_SETUP_ERROR  -1
 #define MIDI_SETUP_SUCCESS 0
 
-MIDI_INLINE int midi_controller_set(MIDI_Controller* controller, const char* filepath, const char* midi_external, const uint8_t external_midi_set_up)
+/* Marks a thread started during setup. The flags go in under the mutex as the threads already started read them */
+MIDI_INLINE void midi_controller_thread_started(MIDI_Controller* controller, const uint16_t thread_flag)
+{
+    pthread_mutex_lock(&controller->mutex);
+    controller->flags |= thread_flag;
+    pthread_mutex_unlock(&controller->mutex);
+}
+
+/* A thread failed to start during setup. Destroy only joins the threads flagged as started and only closes the
+ * external input once its thread runs, so an input opened for a thread that never started is closed here */
+MIDI_INLINE int midi_controller_thread_failed(MIDI_Controller* controller, const int input_open, const char* thread_name)
+{
+    printf(MIDI_COLOR_RED "ERROR - MIDI %s thread creation failed\n" MIDI_COLOR_RESET, thread_name);
+    if (input_open)
+        close(controller->midi_external_input);
+    midi_controller_destrory(controller);
+    return MIDI_SETUP_ERROR;
+}
+
+MIDI_INLINE int midi_controller_set_config(MIDI_Controller* controller, const char* filepath, const char* midi_external, const uint8_t external_midi_set_up, const MIDI_Controller_Config* config)
 {
     if (controller == NULL)
     {
         printf(MIDI_COLOR_RED "ERROR - controller pointer is NULL\n" MIDI_COLOR_RESET);
         return MIDI_SETUP_ERROR;
     }
-    // just incase we got some garbage data in the command queue
-    for (uint8_t i = 0; i < MIDI_COMMAND_MAX_COUNT; ++i)
-        memset(&controller->commands[i], 0, sizeof(MIDI_Command));
-
-    controller->command_count = 0;
-    controller->commands_processed = 0;
-    controller->clock_mode = 0;
-    controller->flags = 0;
-
-    if (filepath != NULL)
+    const MIDI_Controller_Config default_config = {0};
+    if (config == NULL)
+        config = &default_config;
+
+    // controllers can be set again after being destroyed, so start from a clean slate
+    memset(controller, 0, sizeof(MIDI_Controller));
+    controller->shutdown_event = -1;
+    pthread_mutex_init(&controller->mutex, NULL);
+    pthread_cond_init(&controller->cond, NULL);
+    pthread_condattr_t clock_cond_attr;
+    pthread_condattr_init(&clock_cond_attr);
+    pthread_condattr_setclock(&clock_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&controller->clock_cond, &clock_cond_attr);
+    pthread_cond_init(&controller->send_cond, &clock_cond_attr);
+    pthread_condattr_destroy(&clock_cond_attr);
+
+    if (midi_command_queue_init(&controller->commands, config->command_capacity, config->overflow_policy) != 0)
     {
-        midi_parse_commands(controller, filepath);
-
-        // setting the inactive channels to max for simd comparision optimisation
-        for (uint8_t i = 0; i < MIDI_MAX_CHANNELS; ++i)
-        {
-            if (!(controller->active_channels & (1<<i)))
-                --controller->midi_commands.loop_steps[i];
-        }
+        printf(MIDI_COLOR_RED "ERROR - command queue allocation failed\n" MIDI_COLOR_RESET);
+        midi_controller_destrory(controller);
+        return MIDI_SETUP_ERROR;
+    }
+    controller->shutdown_event = eventfd(0, EFD_CLOEXEC);
+    if (controller->shutdown_event < 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - shutdown eventfd creation failed\n" MIDI_COLOR_RESET);
+        midi_controller_destrory(controller);
+        return MIDI_SETUP_ERROR;
+    }
+    if (config->tick_engine == MIDI_TICK_ENGINE_INLINE)
+        controller->flags |= MIDI_TICK_INLINE;
+    controller->midi_commands.burst_limit = config->burst_limit ? config->burst_limit : MIDI_DEFAULT_BURST_LIMIT;
+    controller->midi_commands.ppqn = config->ppqn ? config->ppqn : MIDI_DEFAULT_PPQN;
+    if (controller->midi_commands.ppqn % MIDI_TICKS_PER_QUATER_NOTE != 0)
+    {
+        printf(MIDI_COLOR_YELLOW "WARNING - ppqn %u is not a multiple of 24, using %u\n" MIDI_COLOR_RESET, controller->midi_commands.ppqn, MIDI_DEFAULT_PPQN);
+        controller->midi_commands.ppqn = MIDI_DEFAULT_PPQN;
+    }
+    controller->midi_commands.steps_per_clock = controller->midi_commands.ppqn / MIDI_TICKS_PER_QUATER_NOTE;
+    controller->lookahead_ticks = config->lookahead_ticks;
+    controller->sender_spin_ns = config->sender_spin_ns ? config->sender_spin_ns : MIDI_DEFAULT_SPIN_NS;
+    midi_step_engine_select(&controller->midi_commands, config->step_engine_isa);
+    if (config->scheduler == MIDI_SCHEDULER_HEAP)
+        controller->midi_commands.step_tracks = midi_step_tracks_heap;
+
+    if (filepath != NULL && midi_parse_commands(controller, filepath) != 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - pattern file %s couldn't be loaded\n" MIDI_COLOR_RESET, filepath);
+        midi_controller_destrory(controller);
+        return MIDI_SETUP_ERROR;
     }
+    int input_open = 0; // destroy only closes the external input once its thread runs
     if (midi_external != NULL)
     {
         controller->midi_external_output = open(midi_external, O_WRONLY);
@@ -766,6 +3160,19 @@ MIDI_INLINE int midi_controller_set(MIDI_Controller* controller, const char* fil
         else
             controller->flags |= MIDI_EXTERNAL_CONNECTION;
 
+        if (controller->lookahead_ticks > 0)
+        {
+            controller->outbound.buffer = (MIDI_Outbound_Event*)calloc(MIDI_OUTBOUND_CAPACITY, sizeof(MIDI_Outbound_Event));
+            if (controller->outbound.buffer == NULL)
+            {
+                printf(MIDI_COLOR_RED "ERROR - outbound buffer allocation failed\n" MIDI_COLOR_RESET);
+                midi_controller_destrory(controller);
+                return MIDI_SETUP_ERROR;
+            }
+            controller->outbound.mask = MIDI_OUTBOUND_CAPACITY - 1;
+            controller->flags |= MIDI_LOOKAHEAD;
+        }
+
         if (!(external_midi_set_up & EXTERNAL_INPUT_INACTIVE))
         {
             controller->midi_external_input = open(midi_external, O_RDONLY | O_NONBLOCK);
@@ -775,119 +3182,264 @@ MIDI_INLINE int midi_controller_set(MIDI_Controller* controller, const char* fil
                 midi_controller_destrory(controller);
                 return MIDI_SETUP_ERROR;
             }
-            else
-            {
-                if (external_midi_set_up & EXTERNAL_INPUT_CLOCK)
-                    controller->clock_mode = MIDI_CLOCK_MODE_EXTERNAL;
-                if (external_midi_set_up & EXTERNAL_INPUT_THROUGH)
-                    controller->flags |= MIDI_EXTERNAL_THROUGH;
-
-                controller->flags |= MIDI_EXTERNAL_INPUT;
-
-                pthread_t midi_external_thread;
-                pthread_create(&midi_external_thread, NULL, midi_external_input_thread, controller);
-                pthread_detach(midi_external_thread);
-            }
+            if (external_midi_set_up & EXTERNAL_INPUT_CLOCK)
+                controller->clock_mode = MIDI_CLOCK_MODE_EXTERNAL;
+            if (external_midi_set_up & EXTERNAL_INPUT_THROUGH)
+                controller->flags |= MIDI_EXTERNAL_THROUGH;
+            input_open = 1;
         }
     }
     if (controller->clock_mode == 0)
         controller->clock_mode = MIDI_CLOCK_MODE_INTERNAL;
 
-    pthread_t midi_interface_thread;
-    pthread_create(&midi_interface_thread, NULL, midi_thread_loop, controller);
-    pthread_detach(midi_interface_thread);
+    // the running flags go in as each thread is created, destroy joins only what is flagged.
+    // The sender goes last so the threads that feed it are already running
+    if (!(controller->flags & MIDI_TICK_INLINE)) // inline has no midi thread, the clock source launches the commands
+    {
+        if (midi_thread_create(&controller->midi_thread, midi_thread_loop, controller, &config->thread_config, &controller->midi_thread_report) != 0)
+            return midi_controller_thread_failed(controller, input_open, "interface");
+        midi_controller_thread_started(controller, MIDI_THREAD_RUNNING);
+    }
+    if (input_open)
+    {
+        if (midi_thread_create(&controller->input_thread, midi_external_input_thread, controller, &config->thread_config, &controller->input_thread_report) != 0)
+            return midi_controller_thread_failed(controller, input_open, "external input");
+        midi_controller_thread_started(controller, MIDI_EXTERNAL_INPUT);
+    }
+    if (controller->flags & MIDI_LOOKAHEAD)
+    {
+        if (midi_thread_create(&controller->sender_thread, midi_sender_thread_loop, controller, &config->thread_config, &controller->sender_thread_report) != 0)
+            return midi_controller_thread_failed(controller, 0, "sender");
+        midi_controller_thread_started(controller, MIDI_SENDER_RUNNING);
+    }
 
     return MIDI_SETUP_SUCCESS;
 }
 
-typedef struct
+MIDI_INLINE int midi_controller_set(MIDI_Controller* controller, const char* filepath, const char* midi_external, const uint8_t external_midi_set_up)
 {
-    const long time_between_ticks;
-    MIDI_Controller* controller;
-} MIDI_Clock;
+    return midi_controller_set_config(controller, filepath, midi_external, external_midi_set_up, NULL);
+}
 
+MIDI_INLINE double midi_tempo_clamp(const double bpm)
+{
+    return bpm < MIDI_TEMPO_MIN_BPM ? MIDI_TEMPO_MIN_BPM : (bpm > MIDI_TEMPO_MAX_BPM ? MIDI_TEMPO_MAX_BPM : bpm);
+}
 
-MIDI_INLINE void* midi_clock_thread_loop(void* args)
+MIDI_INLINE uint64_t midi_beat_to_step(const double beat, const uint32_t ppqn)
 {
-    MIDI_Clock* clock = (MIDI_Clock*)args;
-    DEBUG_PRINT("MIDI clock (in thread loop) with time between ticks: %ld. Pointer: %p\n", clock->time_between_ticks, clock->controller);
+    return beat <= 0 ? 0 : (uint64_t)(beat * ppqn + 0.5);
+}
 
-    const long interval_ticks_ns = clock->time_between_ticks;
-    MIDI_Controller* midi_controller = clock->controller;
-    free(clock);
-    DEBUG_PRINT("Clock nsecs: %ld\n", interval_ticks_ns);
+MIDI_INLINE void midi_tempo_hold_locked(MIDI_Tempo* tempo, const double bpm, const uint32_t ppqn)
+{
+    tempo->bpm = midi_tempo_clamp(bpm);
+    tempo->interval_fp = (uint64_t)(60e9 / (tempo->bpm * ppqn) * 4294967296.0 + 0.5);
+    tempo->ramp_length = 0;
+}
 
-    struct timespec next_tick;
-    clock_gettime(CLOCK_MONOTONIC, &next_tick); // get the starting absolute time
-    next_tick.tv_nsec += interval_ticks_ns;
-    if (next_tick.tv_nsec >= 1000000000L)
+MIDI_INLINE void midi_tempo_ramp_locked(MIDI_Tempo* tempo, const double to_bpm, const uint64_t start, const uint64_t length, const MIDI_Tempo_Curve curve, const uint32_t ppqn)
+{
+    if (length == 0 || curve == MIDI_TEMPO_JUMP)
     {
-        ++next_tick.tv_sec;
-        next_tick.tv_nsec -= 1000000000L;
-        assert(next_tick.tv_nsec < 1000000000L && "ERROR - still to much overflow in next time tick");
+        midi_tempo_hold_locked(tempo, to_bpm, ppqn);
+        return;
     }
+    tempo->ramp_from = tempo->bpm;
+    tempo->ramp_to = midi_tempo_clamp(to_bpm);
+    tempo->ramp_start = start;
+    tempo->ramp_length = length;
+    tempo->ramp_curve = curve;
+}
 
-    while(1)
+/* Interval from the step at tempo->position to the next one, then moves position on. Must be called with the controller mutex held */
+MIDI_INLINE uint64_t midi_tempo_next_interval_locked(MIDI_Tempo* tempo, const uint32_t ppqn)
+{
+    // tempo map points reached on this step, each one sets the tempo and how it gets to the next point
+    while (tempo->map_next < tempo->map_count && tempo->position >= midi_beat_to_step(tempo->map[tempo->map_next].beat, ppqn))
     {
-        pthread_mutex_lock(&midi_controller->mutex);
-        DEBUG_PRINT("Queue has %d commands\n",  midi_controller->command_count);
-        if (midi_controller->flags & MIDI_INTERFACE_DESTORY)
+        const MIDI_Tempo_Point* point = &tempo->map[tempo->map_next++];
+        midi_tempo_hold_locked(tempo, point->bpm, ppqn);
+        if (tempo->map_next < tempo->map_count)
         {
-            pthread_mutex_unlock(&midi_controller->mutex);
-            break;
+            const MIDI_Tempo_Point* next = &tempo->map[tempo->map_next];
+            const uint64_t start = midi_beat_to_step(point->beat, ppqn);
+            if (next->curve != MIDI_TEMPO_JUMP)
+                midi_tempo_ramp_locked(tempo, next->bpm, start, midi_beat_to_step(next->beat, ppqn) - start, next->curve, ppqn);
         }
-        assert(midi_controller->clock_mode == MIDI_CLOCK_MODE_MASTER && "ERROR - clock mode not set to master\n");
-        assert(midi_controller->command_count < MIDI_COMMAND_MAX_COUNT);
-        midi_controller->commands[midi_controller->command_count++].command_byte = MIDI_SYSTEM_MESSAGE | MIDI_CLOCK;
-        midi_controller->flags |= MIDI_CLOCK_COMMAND_SENT;
-        if (midi_controller->flags & MIDI_EXTERNAL_CONNECTION)
+    }
+    if (tempo->ramp_length > 0)
+    {
+        const uint64_t elapsed = tempo->position - tempo->ramp_start;
+        if (elapsed >= tempo->ramp_length)
+            midi_tempo_hold_locked(tempo, tempo->ramp_to, ppqn);
+        else
         {
-            uint8_t command = MIDI_SYSTEM_MESSAGE | MIDI_CLOCK;
-            write(midi_controller->midi_external_output, &command, sizeof(uint8_t));
-
+            const double t = (double)elapsed / tempo->ramp_length;
+            const double bpm = tempo->ramp_curve == MIDI_TEMPO_EXPONENTIAL ? tempo->ramp_from * pow(tempo->ramp_to / tempo->ramp_from, t)
+                                                                           : tempo->ramp_from + (tempo->ramp_to - tempo->ramp_from) * t;
+            tempo->bpm = bpm;
+            tempo->interval_fp = (uint64_t)(60e9 / (bpm * ppqn) * 4294967296.0 + 0.5);
         }
-        pthread_cond_signal(&midi_controller->cond);
-        pthread_mutex_unlock(&midi_controller->mutex);
+    }
+    ++tempo->position;
+    return tempo->interval_fp;
+}
 
+MIDI_INLINE void* midi_clock_thread_loop(void* args)
+{
+    MIDI_Controller* midi_controller = (MIDI_Controller*)args;
+    MIDI_Tempo* tempo = &midi_controller->tempo;
+    const uint32_t ppqn = midi_controller->midi_commands.ppqn;
+    // with lookahead the steps run that far ahead of the deadlines they are stamped with, the time follows the tempo
+    const uint64_t lookahead_steps = (uint64_t)midi_controller->lookahead_ticks * midi_controller->midi_commands.steps_per_clock;
+
+    pthread_mutex_lock(&midi_controller->mutex);
+    DEBUG_PRINT("MIDI clock (in thread loop) at %f bpm. Pointer: %p\n", tempo->bpm, midi_controller);
+    uint64_t lookahead_ns = lookahead_steps * (tempo->interval_fp >> 32);
+    // deadline in 32.32 fixed point ns, the whole part is what the steps are stamped with and waited on
+    uint64_t deadline_ns = midi_time_now_ns() + lookahead_ns; // the first tick is due straight away, or a lookahead from now
+    uint32_t deadline_fraction = 0;
+    uint32_t idle_steps = 0;
+    while(!(midi_controller->flags & MIDI_INTERFACE_DESTORY))
+    {
+        assert(midi_controller->clock_mode == MIDI_CLOCK_MODE_MASTER && "ERROR - clock mode not set to master\n");
+        midi_clock_skip_locked(midi_controller, idle_steps);
+        // stamped with the deadline rather than the wake up time so scheduler jitter doesn't reach the consumer
+        midi_clock_step_locked(midi_controller, deadline_ns);
 
-        next_tick.tv_nsec += interval_ticks_ns; // Calculate next tick time to prevents drift
-        if (next_tick.tv_nsec >= 1000000000L)
+        // sleep through the steps with no event and no midi clock due, only the heap scheduler knows of any
+        idle_steps = midi_steps_until_next_event_locked(midi_controller);
+        if (idle_steps > 0)
         {
-            ++next_tick.tv_sec;
-            next_tick.tv_nsec -= 1000000000L;
-            assert(next_tick.tv_nsec < 1000000000L && "ERROR - still to much overflow in next time tick");
+            const uint32_t steps_per_clock = midi_controller->midi_commands.steps_per_clock;
+            const uint32_t until_clock = midi_controller->clock_step == 0 ? 0 : steps_per_clock - midi_controller->clock_step;
+            if (until_clock < idle_steps)
+                idle_steps = until_clock;
         }
-        int result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
-        if (result != 0 && result != EINTR)
+
+        // every step is added on its own, a ramp changes the interval from one to the next
+        for (uint32_t i = 0; i <= idle_steps; ++i)
+        {
+            const uint64_t interval_fp = midi_tempo_next_interval_locked(tempo, ppqn);
+            const uint64_t fraction = (uint64_t)deadline_fraction + (interval_fp & 0xFFFFFFFFu);
+            deadline_ns += (interval_fp >> 32) + (fraction >> 32);
+            deadline_fraction = (uint32_t)fraction;
+        }
+        lookahead_ns = lookahead_steps * (tempo->interval_fp >> 32);
+
+        // absolute deadline wait, destroy signals clock_cond to end it early
+        const struct timespec wake = midi_ns_to_timespec(deadline_ns - lookahead_ns);
+        int result = 0;
+        while (!(midi_controller->flags & MIDI_INTERFACE_DESTORY) && result != ETIMEDOUT)
         {
-            DEBUG_PRINT("WARNING - clock_nanosleep failed: %d\n", result);
+            result = pthread_cond_timedwait(&midi_controller->clock_cond, &midi_controller->mutex, &wake);
+            if (result != 0 && result != ETIMEDOUT)
+            {
+                DEBUG_PRINT("WARNING - pthread_cond_timedwait failed: %d\n", result);
+                break;
+            }
         }
     }
+    pthread_mutex_unlock(&midi_controller->mutex);
 
     DEBUG_PRINT("MIDI clock thread exiting\n", "");
 
     return NULL;
 }
 
+MIDI_INLINE void midi_tempo_set(MIDI_Controller* controller, const float bpm)
+{
+    pthread_mutex_lock(&controller->mutex);
+    MIDI_Tempo_Point* map = controller->tempo.map;
+    controller->tempo.map = NULL;
+    controller->tempo.map_count = 0;
+    midi_tempo_hold_locked(&controller->tempo, bpm, controller->midi_commands.ppqn);
+    pthread_mutex_unlock(&controller->mutex);
+    free(map);
+}
 
-MIDI_INLINE void midi_clock_set(MIDI_Controller* controller, const float bpm)
+MIDI_INLINE void midi_tempo_ramp(MIDI_Controller* controller, const float bpm, const double beats, const MIDI_Tempo_Curve curve)
+{
+    pthread_mutex_lock(&controller->mutex);
+    MIDI_Tempo_Point* map = controller->tempo.map;
+    controller->tempo.map = NULL;
+    controller->tempo.map_count = 0;
+    midi_tempo_ramp_locked(&controller->tempo, bpm, controller->tempo.position, midi_beat_to_step(beats, controller->midi_commands.ppqn), curve,
+                           controller->midi_commands.ppqn);
+    pthread_mutex_unlock(&controller->mutex);
+    free(map);
+}
+
+MIDI_INLINE int midi_tempo_map_set(MIDI_Controller* controller, const MIDI_Tempo_Point* points, const uint32_t count)
+{
+    MIDI_Tempo_Point* map = NULL;
+    if (count > 0)
+    {
+        for (uint32_t i = 1; i < count; ++i)
+        {
+            if (points[i].beat < points[i - 1].beat)
+            {
+                printf(MIDI_COLOR_RED "ERROR - tempo map points not sorted by beat\n" MIDI_COLOR_RESET);
+                return -1;
+            }
+        }
+        map = (MIDI_Tempo_Point*)malloc(count * sizeof(MIDI_Tempo_Point));
+        if (map == NULL)
+        {
+            printf(MIDI_COLOR_RED "ERROR - tempo map allocation failed\n" MIDI_COLOR_RESET);
+            return -1;
+        }
+        memcpy(map, points, count * sizeof(MIDI_Tempo_Point));
+    }
+
+    pthread_mutex_lock(&controller->mutex);
+    MIDI_Tempo_Point* old = controller->tempo.map;
+    controller->tempo.map = map;
+    controller->tempo.map_count = count;
+    controller->tempo.map_next = 0; // points already passed are caught up on the next step
+    pthread_mutex_unlock(&controller->mutex);
+    free(old);
+    return 0;
+}
+
+MIDI_INLINE float midi_tempo_bpm(MIDI_Controller* controller)
+{
+    pthread_mutex_lock(&controller->mutex);
+    const float bpm = (float)controller->tempo.bpm;
+    pthread_mutex_unlock(&controller->mutex);
+    return bpm;
+}
+
+MIDI_INLINE void midi_clock_set_config(MIDI_Controller* controller, const float bpm, const MIDI_Thread_Config* thread_config)
 {
     pthread_mutex_lock(&controller->mutex);
+    if (controller->flags & MIDI_CLOCK_ENABLED)
+    {
+        // one clock thread per controller, calling it again is a tempo change
+        pthread_mutex_unlock(&controller->mutex);
+        midi_tempo_set(controller, bpm);
+        return;
+    }
 
-    const long time_between_ticks = 1000000000L / ((bpm * 24)/60);
-    MIDI_Clock clock = {time_between_ticks, controller};
-    DEBUG_PRINT("MIDI clock (in set) made with time between ticks: %ld. Pointer: %p\n", time_between_ticks, controller);
-    MIDI_Clock* clock_heap = (MIDI_Clock*)malloc(sizeof(MIDI_Clock));
-    memcpy(clock_heap, &clock, sizeof(MIDI_Clock));
+    controller->tempo.position = 0;
+    controller->tempo.map_next = 0;
+    midi_tempo_hold_locked(&controller->tempo, bpm, controller->midi_commands.ppqn);
+    DEBUG_PRINT("MIDI clock (in set) at %f bpm. Pointer: %p\n", bpm, controller);
 
-    controller->flags |= MIDI_CLOCK_ENABLED;
     controller->clock_mode = MIDI_CLOCK_MODE_MASTER;
-    pthread_t midi_clock_thread;
-    pthread_create(&midi_clock_thread, NULL, midi_clock_thread_loop, clock_heap);
-    pthread_detach(midi_clock_thread);
+    if (midi_thread_create(&controller->clock_thread, midi_clock_thread_loop, controller, thread_config, &controller->clock_thread_report) != 0)
+        printf(MIDI_COLOR_RED "ERROR - MIDI clock thread creation failed\n" MIDI_COLOR_RESET);
+    else
+        controller->flags |= MIDI_CLOCK_ENABLED;
     pthread_mutex_unlock(&controller->mutex);
 }
 
+MIDI_INLINE void midi_clock_set(MIDI_Controller* controller, const float bpm)
+{
+    midi_clock_set_config(controller, bpm, NULL);
+}
+
 MIDI_INLINE void midi_command_byte_parse(const uint8_t commmand_byte, uint8_t* out_type, uint8_t* out_channel)
 {
     *out_type = commmand_byte & MIDI_COMMAND_TYPE_BYTE_MASK;
@@ -897,99 +3449,305 @@ MIDI_INLINE void midi_command_byte_parse(const uint8_t commmand_byte, uint8_t* o
 MIDI_INLINE void midi_command_clock(MIDI_Controller* controller)
 {
     pthread_mutex_lock(&controller->mutex);
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
     assert(controller->clock_mode == MIDI_CLOCK_MODE_INTERNAL && "ERROR - clock mode not set to internal\n");
-    controller->commands[controller->command_count++].command_byte = MIDI_SYSTEM_MESSAGE | MIDI_CLOCK;
-    controller->flags |= MIDI_CLOCK_COMMAND_SENT;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-    {
-        uint8_t command = MIDI_SYSTEM_MESSAGE | MIDI_CLOCK;
-        write(controller->midi_external_output, &command, sizeof(uint8_t));
-
-    }
-    pthread_cond_signal(&controller->cond);
+    midi_clock_tick_locked(controller, midi_time_now_ns());
     pthread_mutex_unlock(&controller->mutex);
 
 }
 
 MIDI_INLINE void midi_start(MIDI_Controller* controller)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
     pthread_mutex_lock(&controller->mutex);
-    controller->commands[controller->command_count++].command_byte = MIDI_SYSTEM_MESSAGE | MIDI_START;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-    {
-        uint8_t command = MIDI_SYSTEM_MESSAGE | MIDI_START;
-        write(controller->midi_external_output, &command, sizeof(uint8_t));
-
-    }
+    midi_transport_set_locked(controller, MIDI_TRANSPORT_PLAYING, MIDI_START);
     pthread_mutex_unlock(&controller->mutex);
 }
 
 MIDI_INLINE void midi_continue(MIDI_Controller* controller)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
     pthread_mutex_lock(&controller->mutex);
-    controller->commands[controller->command_count++].command_byte = MIDI_SYSTEM_MESSAGE | MIDI_CONTINUE;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-    {
-        uint8_t command = MIDI_SYSTEM_MESSAGE | MIDI_CONTINUE;
-        write(controller->midi_external_output, &command, sizeof(uint8_t));
-
-    }
+    midi_transport_set_locked(controller, MIDI_TRANSPORT_PLAYING, MIDI_CONTINUE);
     pthread_mutex_unlock(&controller->mutex);
 }
 
 MIDI_INLINE void midi_stop(MIDI_Controller* controller)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
     pthread_mutex_lock(&controller->mutex);
-    controller->commands[controller->command_count++].command_byte = MIDI_SYSTEM_MESSAGE | MIDI_STOP;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-    {
-        uint8_t command = MIDI_SYSTEM_MESSAGE | MIDI_STOP;
-        write(controller->midi_external_output, &command, sizeof(uint8_t));
-
-    }
+    midi_transport_set_locked(controller, MIDI_TRANSPORT_STOPPED, MIDI_STOP);
     pthread_mutex_unlock(&controller->mutex);
 }
-MIDI_INLINE void midi_message_send(MIDI_Controller* controller, const uint8_t command_byte, const uint8_t param1, const uint8_t param2)
+MIDI_INLINE int midi_message_send(MIDI_Controller* controller, const uint8_t command_byte, const uint8_t param1, const uint8_t param2)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
+    const uint64_t timestamp_ns = midi_time_now_ns();
     pthread_mutex_lock(&controller->mutex);
-    MIDI_Command* command = &controller->commands[controller->command_count++];
-    command->command_byte = command_byte;
-    command->param1 = param1;
-    command->param2 = param2;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-        write(controller->midi_external_output, &command, sizeof(MIDI_Command));
+    const int result = midi_message_send_locked(controller, (MIDI_Command){command_byte, param1, param2}, timestamp_ns);
     pthread_mutex_unlock(&controller->mutex);
+    return result;
 }
 
-MIDI_INLINE void midi_note_on(MIDI_Controller* controller, MIDI_Channels channel, const float frequency, const uint8_t velocity)
+MIDI_INLINE int midi_message_send_batch(MIDI_Controller* controller, const MIDI_Command* commands, const uint32_t count)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
+    if (count == 0)
+        return 0;
+
+    const uint64_t timestamp_ns = midi_time_now_ns();
     pthread_mutex_lock(&controller->mutex);
-    MIDI_Command* command = &controller->commands[controller->command_count++];
-    command->command_byte = MIDI_NOTE_ON | channel;
-    command->param1 = midi_frequency_to_midi_note(frequency);
-    command->param2 = velocity;
+    MIDI_Command_Queue* queue = &controller->commands;
+    if (queue->overflow_policy == MIDI_OVERFLOW_REJECT && midi_command_queue_space(queue) < count)
+    {
+        // all or nothing, half a chord is worse than a late one
+        atomic_fetch_add_explicit(&queue->rejected, count, memory_order_relaxed);
+        pthread_mutex_unlock(&controller->mutex);
+        return MIDI_QUEUE_FULL;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+        midi_event_push(controller, commands[i], timestamp_ns);
     if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-        write(controller->midi_external_output, &command, sizeof(MIDI_Command));
+        midi_message_write_batch(controller, commands, count);
     pthread_mutex_unlock(&controller->mutex);
+    return count;
+}
+
+MIDI_INLINE void midi_recorder_put(MIDI_Recorder_Track* track, const uint8_t* bytes, const uint32_t count)
+{
+    if (track->length + count > track->capacity)
+    {
+        uint32_t capacity = track->capacity ? track->capacity : 4096;
+        while (track->length + count > capacity)
+            capacity *= 2;
+        uint8_t* data = (uint8_t*)realloc(track->data, capacity);
+        if (data == NULL)
+            return; // the event is lost, the track stays valid
+        track->data = data;
+        track->capacity = capacity;
+    }
+    memcpy(track->data + track->length, bytes, count);
+    track->length += count;
+}
+
+MIDI_INLINE uint32_t midi_recorder_vlq(uint8_t* out, uint32_t value)
+{
+    uint8_t reversed[4];
+    uint32_t count = 0;
+    do
+    {
+        reversed[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value && count < 4);
+    for (uint32_t i = 0; i < count; ++i)
+        out[i] = reversed[count - 1 - i] | (i + 1 < count ? 0x80 : 0);
+    return count;
+}
+
+MIDI_INLINE uint64_t midi_recorder_tick(const MIDI_Recorder* recorder, const uint64_t timestamp_ns)
+{
+    if (timestamp_ns <= recorder->file_start_ns)
+        return 0;
+    const uint64_t elapsed_us = (timestamp_ns - recorder->file_start_ns) / 1000;
+    return (elapsed_us * MIDI_RECORDER_DIVISION + MIDI_RECORDER_TEMPO_US / 2) / MIDI_RECORDER_TEMPO_US;
+}
+
+/* Writes the file recorded up to end_ns and starts the next one there */
+MIDI_INLINE void midi_recorder_rotate(MIDI_Recorder* recorder, const uint64_t end_ns)
+{
+    if (recorder->file_bytes > 0)
+    {
+        const size_t name_length = strlen(recorder->path) + 16;
+        char* name = (char*)malloc(name_length);
+        FILE* file = NULL;
+        if (name != NULL)
+        {
+            snprintf(name, name_length, "%s_%03u.mid", recorder->path, recorder->files);
+            file = fopen(name, "wb");
+        }
+        if (file == NULL)
+            printf(MIDI_COLOR_RED "ERROR - recorder couldn't open %s, the recording is lost\n" MIDI_COLOR_RESET, name ? name : recorder->path);
+        else
+        {
+            uint16_t track_count = 1;
+            for (uint8_t i = 1; i < MIDI_RECORDER_TRACKS; ++i)
+                track_count += recorder->tracks[i].length > 0;
+            const uint8_t header[14] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, track_count >> 8, track_count & 0xFF,
+                                        MIDI_RECORDER_DIVISION >> 8, MIDI_RECORDER_DIVISION & 0xFF};
+            fwrite(header, 1, sizeof(header), file);
+
+            // the tempo track runs to the end of the file so back to back files add up to the whole session
+            uint8_t tempo[16] = {0x00, 0xFF, 0x51, 0x03, (MIDI_RECORDER_TEMPO_US >> 16) & 0xFF, (MIDI_RECORDER_TEMPO_US >> 8) & 0xFF,
+                                 MIDI_RECORDER_TEMPO_US & 0xFF};
+            uint64_t end_tick = midi_recorder_tick(recorder, end_ns);
+            for (uint8_t i = 1; i < MIDI_RECORDER_TRACKS; ++i)
+            {
+                if (recorder->tracks[i].last_tick > end_tick)
+                    end_tick = recorder->tracks[i].last_tick; // commands rendered ahead are stamped after the stop
+            }
+            uint32_t tempo_length = 7 + midi_recorder_vlq(tempo + 7, end_tick > 0x0FFFFFFF ? 0x0FFFFFFF : (uint32_t)end_tick);
+            tempo[tempo_length++] = 0xFF;
+            tempo[tempo_length++] = 0x2F;
+            tempo[tempo_length++] = 0x00;
+            for (uint8_t i = 0; i < MIDI_RECORDER_TRACKS; ++i)
+            {
+                MIDI_Recorder_Track* track = &recorder->tracks[i];
+                if (i > 0 && track->length == 0)
+                    continue;
+                const uint32_t length = i == 0 ? tempo_length : track->length + 4;
+                const uint8_t chunk[8] = {'M', 'T', 'r', 'k', length >> 24, (length >> 16) & 0xFF, (length >> 8) & 0xFF, length & 0xFF};
+                const uint8_t end_of_track[4] = {0x00, 0xFF, 0x2F, 0x00};
+                fwrite(chunk, 1, sizeof(chunk), file);
+                if (i == 0)
+                    fwrite(tempo, 1, tempo_length, file);
+                else
+                {
+                    fwrite(track->data, 1, track->length, file);
+                    fwrite(end_of_track, 1, sizeof(end_of_track), file);
+                }
+            }
+            if (fclose(file) != 0)
+                printf(MIDI_COLOR_RED "ERROR - recorder couldn't write %s\n" MIDI_COLOR_RESET, name);
+            DEBUG_PRINT("recorder wrote %s, %lu bytes of events\n", name, (unsigned long)recorder->file_bytes);
+            ++recorder->files;
+        }
+        free(name);
+    }
+    for (uint8_t i = 0; i < MIDI_RECORDER_TRACKS; ++i)
+    {
+        recorder->tracks[i].length = 0; // the buffers are kept for the next file
+        recorder->tracks[i].last_tick = 0;
+        recorder->tracks[i].running_status = 0;
+    }
+    recorder->file_bytes = 0;
+    recorder->file_start_ns = end_ns;
+}
+
+/* Starts the next file once max_seconds have passed, on the boundary so the files line up with the session */
+MIDI_INLINE void midi_recorder_rotate_time(MIDI_Recorder* recorder, const uint64_t now_ns)
+{
+    if (recorder->max_ns == 0 || now_ns < recorder->file_start_ns + recorder->max_ns)
+        return;
+    if (recorder->file_bytes > 0)
+        midi_recorder_rotate(recorder, recorder->file_start_ns + recorder->max_ns);
+    // nothing was played for a while, no empty files
+    recorder->file_start_ns += (now_ns - recorder->file_start_ns) / recorder->max_ns * recorder->max_ns;
+}
+
+MIDI_INLINE void midi_recorder_write_event(MIDI_Recorder* recorder, const MIDI_Event* event)
+{
+    const uint8_t status = event->command.command_byte;
+    if ((status & MIDI_COMMAND_TYPE_BYTE_MASK) == MIDI_SYSTEM_MESSAGE)
+        return; // system messages can't go in a midi file track
+    midi_recorder_rotate_time(recorder, event->timestamp_ns);
+
+    MIDI_Recorder_Track* track = &recorder->tracks[1 + (status & MIDI_COMMAND_CHANNEL_BYTE_MASK)];
+    uint64_t tick = midi_recorder_tick(recorder, event->timestamp_ns);
+    if (tick < track->last_tick)
+        tick = track->last_tick; // through traffic can be stamped before sequenced commands rendered ahead
+    const uint64_t delta = tick - track->last_tick;
+    track->last_tick = tick;
+
+    uint8_t bytes[8];
+    uint32_t count = midi_recorder_vlq(bytes, delta > 0x0FFFFFFF ? 0x0FFFFFFF : (uint32_t)delta);
+    if (status != track->running_status)
+        bytes[count++] = status;
+    track->running_status = status;
+    bytes[count++] = event->command.param1;
+    if (midi_command_length(status) == 3)
+        bytes[count++] = event->command.param2;
+    midi_recorder_put(track, bytes, count);
+    recorder->file_bytes += count;
+    ++recorder->events;
+
+    if (recorder->max_bytes && recorder->file_bytes >= recorder->max_bytes)
+        midi_recorder_rotate(recorder, event->timestamp_ns);
+}
+
+static void* midi_recorder_thread_loop(void* arg)
+{
+    MIDI_Recorder* recorder = (MIDI_Recorder*)arg;
+    const struct timespec period = {recorder->period_ms / 1000, (long)(recorder->period_ms % 1000) * 1000000};
+    MIDI_Event event;
+    uint8_t running = 1;
+    while (running)
+    {
+        // read before draining so the last pass picks up everything sent before stop
+        running = atomic_load_explicit(&recorder->running, memory_order_acquire);
+        while (midi_consumer_poll(recorder->controller, recorder->consumer, &event))
+            midi_recorder_write_event(recorder, &event);
+        midi_recorder_rotate_time(recorder, midi_time_now_ns());
+        if (running)
+            nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+MIDI_INLINE int midi_recorder_start(MIDI_Controller* controller, MIDI_Recorder* recorder, const MIDI_Recorder_Config* config)
+{
+    // checked before the recorder is cleared, it can be the one already running
+    if (controller->recorder != NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - controller already has a recorder running\n" MIDI_COLOR_RESET);
+        return -1;
+    }
+    if (config == NULL || config->path == NULL)
+    {
+        printf(MIDI_COLOR_RED "ERROR - recorder needs a path\n" MIDI_COLOR_RESET);
+        return -1;
+    }
+    memset(recorder, 0, sizeof(MIDI_Recorder));
+    recorder->path = (char*)malloc(strlen(config->path) + 1);
+    if (recorder->path == NULL)
+        return -1;
+    strcpy(recorder->path, config->path);
+    recorder->controller = controller;
+    recorder->max_bytes = config->max_bytes;
+    recorder->max_ns = (uint64_t)config->max_seconds * MIDI_NSEC_PER_SEC;
+    recorder->period_ms = config->period_ms ? config->period_ms : MIDI_RECORDER_DEFAULT_PERIOD_MS;
+    recorder->consumer = midi_consumer_register(controller, MIDI_CONSUMER_SKIP_AHEAD);
+    if (recorder->consumer < 0)
+    {
+        free(recorder->path);
+        return -1;
+    }
+    recorder->file_start_ns = midi_time_now_ns();
+    atomic_init(&recorder->running, 1);
+    if (pthread_create(&recorder->thread, NULL, midi_recorder_thread_loop, recorder) != 0)
+    {
+        printf(MIDI_COLOR_RED "ERROR - recorder thread creation failed\n" MIDI_COLOR_RESET);
+        midi_consumer_unregister(controller, recorder->consumer);
+        free(recorder->path);
+        return -1;
+    }
+    controller->recorder = recorder;
+    return 0;
+}
+
+MIDI_INLINE void midi_recorder_stop(MIDI_Recorder* recorder)
+{
+    if (!atomic_load_explicit(&recorder->running, memory_order_relaxed))
+        return;
+    const uint64_t stop_ns = midi_time_now_ns();
+    atomic_store_explicit(&recorder->running, 0, memory_order_release);
+    pthread_join(recorder->thread, NULL);
+
+    midi_recorder_rotate(recorder, stop_ns);
+    recorder->skipped = midi_consumer_skipped(recorder->controller, recorder->consumer);
+    midi_consumer_unregister(recorder->controller, recorder->consumer);
+    recorder->controller->recorder = NULL;
+    for (uint8_t i = 0; i < MIDI_RECORDER_TRACKS; ++i)
+    {
+        free(recorder->tracks[i].data);
+        recorder->tracks[i].data = NULL;
+        recorder->tracks[i].capacity = 0;
+    }
+    free(recorder->path);
+    recorder->path = NULL;
+}
+
+MIDI_INLINE void midi_note_on(MIDI_Controller* controller, MIDI_Channels channel, const float frequency, const uint8_t velocity)
+{
+    midi_message_send(controller, MIDI_NOTE_ON | channel, midi_frequency_to_midi_note(frequency), velocity);
 }
 
 MIDI_INLINE void midi_note_off(MIDI_Controller* controller, MIDI_Channels channel, const float frequency, const uint8_t velocity)
 {
-    assert(controller->command_count < MIDI_COMMAND_MAX_COUNT);
-    pthread_mutex_lock(&controller->mutex);
-    MIDI_Command* command = &controller->commands[controller->command_count++];
-    command->command_byte = MIDI_NOTE_OFF | channel;
-    command->param1 = midi_frequency_to_midi_note(frequency);
-    command->param2 = velocity;
-    if (controller->flags & MIDI_EXTERNAL_CONNECTION)
-        write(controller->midi_external_output, &command, sizeof(MIDI_Command));
-    pthread_mutex_unlock(&controller->mutex);
+    midi_message_send(controller, MIDI_NOTE_OFF | channel, midi_frequency_to_midi_note(frequency), velocity);
 }
 
 MIDI_INLINE uint8_t midi_frequency_to_midi_note(const float frequency)
@@ -0,0 +1,80 @@
+/* Generates a 2.3 MB text library of 4000 tracks with 40 events each, and times setting up a controller with it as text
+ * and as a pattern image */
+#include "midi_bench.h"
+
+#define IMAGE_TRACKS 4000
+#define IMAGE_PAIRS 20 // per track, an ON and its OFF
+#define IMAGE_PPQN 96
+
+static const uint32_t image_frequencies[] = {220, 330, 440, 550, 660};
+
+static uint32_t image_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int image_write_library(char* path)
+{
+    FILE* file = midi_bench_temp_file(path);
+    if (file == NULL)
+        return -1;
+    uint32_t state = 0x9E3779B9u;
+    for (uint32_t t = 0; t < IMAGE_TRACKS; ++t)
+    {
+        fprintf(file, "{\nCHANNEL: %u\nloop_bars: 4\n", t % 16 + 1);
+        for (uint32_t i = 0; i < IMAGE_PAIRS; ++i)
+        {
+            const uint32_t random = image_random(&state);
+            fprintf(file, "ON(%u,%u,%.2f) OFF(%.2f) ", image_frequencies[random % 5], (random >> 8) % 127 + 1, 1 + i * 0.75,
+                    1.5 + i * 0.75);
+        }
+        fprintf(file, "\n}\n");
+    }
+    return fclose(file);
+}
+
+/* Best set up time in ms, -1 if it failed */
+static double image_time_setup(const char* path)
+{
+    double best = 1e30;
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        MIDI_Controller controller;
+        MIDI_Controller_Config config = {0};
+        config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+        config.ppqn = IMAGE_PPQN;
+        const double start = midi_bench_ns();
+        if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+            return -1;
+        const double setup = midi_bench_ns() - start;
+        if (setup < best)
+            best = setup;
+        midi_controller_destrory(&controller);
+    }
+    return best / 1e6;
+}
+
+int main(void)
+{
+    char text[] = "/tmp/midi_bench_library_XXXXXX";
+    char image[] = "/tmp/midi_bench_image_XXXXXX";
+    const int image_fd = mkstemp(image);
+    if (image_write_library(text) != 0 || image_fd < 0)
+        return 1;
+    close(image_fd);
+    if (midi_pattern_image_write(text, image, IMAGE_PPQN) == 0)
+    {
+        struct stat text_stat, image_stat;
+        stat(text, &text_stat);
+        stat(image, &image_stat);
+        printf("%.1f MB text library, %u tracks, %u events: parsed in %.1f ms\n", text_stat.st_size / 1e6, IMAGE_TRACKS,
+               IMAGE_TRACKS * IMAGE_PAIRS * 2, image_time_setup(text));
+        printf("%.1f MB image at %u PPQN: mapped in %.2f ms\n", image_stat.st_size / 1e6, IMAGE_PPQN, image_time_setup(image));
+    }
+    unlink(text);
+    unlink(image);
+    return 0;
+}
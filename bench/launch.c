@@ -0,0 +1,73 @@
+/* One track with an event on every step, 10k and 1M events long. Timed clocked with the inline engine, where each step
+ * is one launch, and with midi_command_launch called on its own to see the pattern array walk without the clock */
+#include "midi_bench.h"
+
+#define LAUNCH_STEPS 2000000
+#define LAUNCH_CHUNK 2048 // steps clocked between queue drains
+
+static int launch_write_pattern(char* path, const uint32_t events)
+{
+    FILE* file = midi_bench_temp_file(path);
+    if (file == NULL)
+        return -1;
+    const uint32_t bar_steps = MIDI_DEFAULT_PPQN * 4;
+    fprintf(file, "{\nCHANNEL: 1\nloop_bars: %u\n", (events + bar_steps - 1) / bar_steps);
+    for (uint32_t k = 0; k < events; ++k) // half a step in, so rounding down lands on step k
+        fprintf(file, "#(90,%02X,64,%.6f) ", k % 128, 1 + (k + 0.5) / MIDI_DEFAULT_PPQN);
+    fprintf(file, "\n}\n");
+    return fclose(file);
+}
+
+static void launch_run(const uint32_t events)
+{
+    char path[] = "/tmp/midi_bench_launch_XXXXXX";
+    if (launch_write_pattern(path, events) != 0)
+        return;
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.command_capacity = LAUNCH_CHUNK;
+    if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+    {
+        unlink(path);
+        return;
+    }
+    double best[2] = {1e30, 1e30};
+    uint64_t launched[2] = {0};
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        for (uint32_t alone = 0; alone < 2; ++alone)
+        {
+            double total = 0;
+            launched[alone] = 0;
+            for (uint32_t step = 0; step < LAUNCH_STEPS; step += LAUNCH_CHUNK)
+            {
+                const double start = midi_bench_ns();
+                for (uint32_t i = 0; i < LAUNCH_CHUNK; ++i)
+                {
+                    if (alone) // no other thread runs, so the lock the clock takes isn't needed
+                        midi_command_launch(&controller, 0);
+                    else
+                        midi_command_clock(&controller);
+                }
+                total += midi_bench_ns() - start;
+                MIDI_Command command;
+                while (midi_commands_poll(&controller, &command))
+                    ++launched[alone];
+            }
+            if (total < best[alone])
+                best[alone] = total;
+        }
+    }
+    printf("%u events: %.2f ns per clocked launch, %.2f ns per midi_command_launch\n", events,
+           best[0] / launched[0], best[1] / launched[1]);
+    midi_controller_destrory(&controller);
+    unlink(path);
+}
+
+int main(void)
+{
+    launch_run(10000);
+    launch_run(1000000);
+    return 0;
+}
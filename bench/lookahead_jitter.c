@@ -0,0 +1,135 @@
+/* The master clock at 250 bpm into a pty, a midi clock every 10 ms, with the output written on the tick and with a 4
+ * tick lookahead. Prints how far the 0xF8 intervals arriving on the master side are from 10 ms.
+ * Arguments: busy threads to load the CPUs with, and 1 to run the interface threads at SCHED_FIFO 80 and the reader at
+ * 90, which needs CAP_SYS_NICE. Without real-time priority the sender's spin competes with the load */
+#include "midi_bench.h"
+#include <termios.h>
+
+#define JITTER_BPM 250.0f
+#define JITTER_INTERVAL_NS 10000000.0
+#define JITTER_CLOCKS 400
+#define JITTER_LOOKAHEAD_TICKS 4
+
+typedef struct
+{
+    int master;
+    volatile int running;
+    double deviations[JITTER_CLOCKS]; // us away from the interval
+    uint32_t count;
+} Jitter_Reader;
+
+static volatile int jitter_busy = 1;
+
+static void* jitter_burn(void* arg)
+{
+    (void)arg;
+    while (jitter_busy)
+        ;
+    return NULL;
+}
+
+static void* jitter_read(void* arg)
+{
+    Jitter_Reader* reader = (Jitter_Reader*)arg;
+    double last_ns = 0;
+    uint8_t buffer[256];
+    while (reader->running && reader->count < JITTER_CLOCKS)
+    {
+        struct pollfd fds = {reader->master, POLLIN, 0};
+        if (poll(&fds, 1, 100) <= 0)
+            continue;
+        const ssize_t bytes = read(reader->master, buffer, sizeof(buffer));
+        const double now = midi_bench_ns();
+        for (ssize_t i = 0; i < bytes && reader->count < JITTER_CLOCKS; ++i)
+        {
+            if (buffer[i] != (MIDI_SYSTEM_MESSAGE | MIDI_CLOCK))
+                continue;
+            if (last_ns != 0)
+                reader->deviations[reader->count++] = fabs(now - last_ns - JITTER_INTERVAL_NS) / 1e3;
+            last_ns = now;
+        }
+    }
+    return NULL;
+}
+
+static int jitter_compare(const void* a, const void* b)
+{
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void jitter_run(const char* device, const int master, const uint32_t lookahead_ticks, const int realtime)
+{
+    static Jitter_Reader reader;
+    reader.master = master;
+    reader.running = 1;
+    reader.count = 0;
+    tcflush(master, TCIFLUSH);
+    pthread_t thread;
+    pthread_create(&thread, NULL, jitter_read, &reader);
+    if (realtime)
+    {
+        struct sched_param param = {.sched_priority = 90};
+        pthread_setschedparam(thread, SCHED_FIFO, &param);
+    }
+
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.lookahead_ticks = lookahead_ticks;
+    MIDI_Thread_Config thread_config = {0};
+    if (realtime)
+        thread_config = (MIDI_Thread_Config){SCHED_FIFO, 80, 0, 0};
+    config.thread_config = thread_config;
+    if (midi_controller_set_config(&controller, NULL, device, EXTERNAL_INPUT_INACTIVE, &config) == MIDI_SETUP_SUCCESS)
+    {
+        midi_clock_set_config(&controller, JITTER_BPM, &thread_config);
+        pthread_join(thread, NULL);
+        midi_controller_destrory(&controller);
+    }
+    else
+    {
+        reader.running = 0;
+        pthread_join(thread, NULL);
+    }
+    if (reader.count == 0)
+        return;
+
+    double sum = 0;
+    for (uint32_t i = 0; i < reader.count; ++i)
+        sum += reader.deviations[i];
+    qsort(reader.deviations, reader.count, sizeof(double), jitter_compare);
+    printf("lookahead %u: %u clocks, us from 10 ms mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n", lookahead_ticks, reader.count,
+           sum / reader.count, reader.deviations[reader.count / 2], reader.deviations[reader.count * 99 / 100],
+           reader.deviations[reader.count - 1]);
+}
+
+int main(int argc, char** argv)
+{
+    const uint32_t busy_threads = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+    const int realtime = argc > 2 ? atoi(argv[2]) : 0;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+        return 1;
+    const char* device = ptsname(master);
+    struct termios raw;
+    int slave = open(device, O_RDWR | O_NOCTTY); // kept open so the master never sees a hangup between runs
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+
+    pthread_t* burners = (pthread_t*)malloc((busy_threads + 1) * sizeof(pthread_t));
+    for (uint32_t i = 0; i < busy_threads; ++i)
+        pthread_create(&burners[i], NULL, jitter_burn, NULL);
+    printf("%u busy threads, %s priority\n", busy_threads, realtime ? "SCHED_FIFO" : "default");
+    jitter_run(device, master, 0, realtime);
+    jitter_run(device, master, JITTER_LOOKAHEAD_TICKS, realtime);
+    jitter_busy = 0;
+    for (uint32_t i = 0; i < busy_threads; ++i)
+        pthread_join(burners[i], NULL);
+    free(burners);
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* Shared by the benchmarks. Each one is a file built against the header with -O2 and run from the repo root, see the README.
+ * They generate their own input and print what they measured, the numbers depend on the machine */
+#pragma once
+#define _GNU_SOURCE
+#define MIDI_INTERFACE_IMPLEMENTATION
+#include "../MIDI_interface.h"
+
+#define MIDI_BENCH_RUNS 7 // the best of this many runs is reported
+
+MIDI_INLINE double midi_bench_ns(void)
+{
+    return (double)midi_time_now_ns();
+}
+
+/* A temporary file to generate input into, path must end in XXXXXX and is filled in. Unlink it when done */
+MIDI_INLINE FILE* midi_bench_temp_file(char* path)
+{
+    const int fd = mkstemp(path);
+    return fd >= 0 ? fdopen(fd, "w") : NULL;
+}
+
+/* tracks 1 to 4 bar loops long, round robin over the channels, with a note on and off in each loop */
+MIDI_INLINE int midi_bench_write_tracks(char* path, const uint32_t tracks)
+{
+    FILE* file = midi_bench_temp_file(path);
+    if (file == NULL)
+        return -1;
+    for (uint32_t t = 0; t < tracks; ++t)
+    {
+        const uint32_t beat = 1 + t % 4, note = 36 + t % 48;
+        fprintf(file, "{\nCHANNEL: %u\nloop_bars: %u\n#(90,%02X,64,%u) #(80,%02X,00,%u.5)\n}\n", t % 16 + 1, 1 + t % 4,
+                note, beat, note, beat);
+    }
+    return fclose(file);
+}
@@ -0,0 +1,93 @@
+/* Generates 8 MB and 32 MB text patterns of 4 bar tracks with 16 note pairs each, and times the scanner alone on the
+ * text in memory and a whole controller setup from the file, compile included */
+#include "midi_bench.h"
+
+static const uint32_t parse_sizes_mb[] = {8, 32};
+static const char* parse_frequencies[] = {"130.81", "261.63", "329.63", "440.00", "523.25"};
+
+static uint32_t parse_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int parse_write_pattern(char* path, const size_t bytes)
+{
+    FILE* file = midi_bench_temp_file(path);
+    if (file == NULL)
+        return -1;
+    uint32_t state = 0x9E3779B9u;
+    for (uint32_t t = 0; ftell(file) < (long)bytes; ++t)
+    {
+        fprintf(file, "{\nCHANNEL: %u\nloop_bars: 4\n", t % 16 + 1);
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            const uint32_t random = parse_random(&state);
+            const char* frequency = parse_frequencies[random % 5];
+            fprintf(file, "ON(%s,%u,%.3f) OFF(%s,0,%.3f) ", frequency, (random >> 8) % 127 + 1, 1 + i * 0.5, frequency,
+                    1.25 + i * 0.5);
+        }
+        fprintf(file, "\n}\n");
+    }
+    return fclose(file);
+}
+
+static void parse_run(const uint32_t size_mb)
+{
+    char path[] = "/tmp/midi_bench_parse_XXXXXX";
+    if (parse_write_pattern(path, (size_t)size_mb << 20) != 0)
+        return;
+    struct stat file_stat;
+    stat(path, &file_stat);
+    const size_t length = (size_t)file_stat.st_size;
+    char* text = (char*)malloc(length);
+    FILE* file = fopen(path, "rb");
+    const int read = text != NULL && file != NULL && fread(text, 1, length, file) == length;
+    if (file != NULL)
+        fclose(file);
+    if (!read)
+    {
+        free(text);
+        unlink(path);
+        return;
+    }
+
+    double scan = 1e30, load = 1e30;
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        MIDI_Parsed_Pattern parsed;
+        memset(&parsed, 0, sizeof(parsed));
+        double start = midi_bench_ns();
+        const int result = midi_parse_command_lists(MIDI_DEFAULT_PPQN, text, length, &parsed);
+        const double scanned = midi_bench_ns() - start;
+        midi_parsed_free(&parsed);
+        if (result != 0)
+            break;
+        if (scanned < scan)
+            scan = scanned;
+
+        MIDI_Controller controller;
+        MIDI_Controller_Config config = {0};
+        config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+        start = midi_bench_ns();
+        if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+            break;
+        const double loaded = midi_bench_ns() - start;
+        if (loaded < load)
+            load = loaded;
+        midi_controller_destrory(&controller);
+    }
+    printf("%.1f MB: scanned in %.0f ms (%.0f MB/s), loaded in %.0f ms (%.0f MB/s)\n", length / 1e6, scan / 1e6,
+           length / (scan / 1e3), load / 1e6, length / (load / 1e3));
+    free(text);
+    unlink(path);
+}
+
+int main(void)
+{
+    for (uint32_t i = 0; i < sizeof(parse_sizes_mb) / sizeof(parse_sizes_mb[0]); ++i)
+        parse_run(parse_sizes_mb[i]);
+    return 0;
+}
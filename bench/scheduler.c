@@ -0,0 +1,84 @@
+/* 16, 256 and 4096 tracks at 960 PPQN, where most steps have nothing due, stepped with the scan and the heap scheduler.
+ * Also counts the steps the internal clock has to wake for with the heap, an event or a midi clock due */
+#include "midi_bench.h"
+
+#define SCHEDULER_PPQN 960
+#define SCHEDULER_BARS 16
+#define SCHEDULER_BAR_STEPS (SCHEDULER_PPQN * 4) // timed a bar at a time, the queue is drained in between
+
+static const uint32_t scheduler_track_counts[] = {16, 256, 4096};
+#define SCHEDULER_TRACK_SIZES (sizeof(scheduler_track_counts) / sizeof(scheduler_track_counts[0]))
+
+/* Best ns per step, -1 if the controller couldn't be set up. wakes is how often the internal clock would wake */
+static double scheduler_run(const char* path, const MIDI_Step_Scheduler scheduler, uint32_t* wakes)
+{
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.command_capacity = 1 << 16;
+    config.ppqn = SCHEDULER_PPQN;
+    config.scheduler = scheduler;
+    if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+        return -1;
+    double best = 1e30;
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        double total = 0;
+        for (uint32_t bar = 0; bar < SCHEDULER_BARS; ++bar)
+        {
+            const double start = midi_bench_ns();
+            for (uint32_t step = 0; step < SCHEDULER_BAR_STEPS; ++step) // no other thread runs, so no lock
+                midi_sequencer_advance_locked(&controller, 1);
+            total += midi_bench_ns() - start;
+            MIDI_Command command;
+            while (midi_commands_poll(&controller, &command))
+                ;
+        }
+        if (total < best)
+            best = total;
+    }
+
+    // the clock sleeps through steps with no event due, but wakes for every midi clock
+    *wakes = 0;
+    const uint32_t steps_per_clock = controller.midi_commands.steps_per_clock;
+    const uint32_t total_steps = SCHEDULER_BARS * SCHEDULER_BAR_STEPS;
+    for (uint32_t step = 0; step < total_steps;)
+    {
+        const uint32_t idle = midi_steps_until_next_event(&controller);
+        const uint32_t to_clock = (steps_per_clock - step % steps_per_clock) % steps_per_clock;
+        uint32_t steps = idle < to_clock ? idle : to_clock;
+        if (steps == 0) // something due on this step
+        {
+            ++*wakes;
+            steps = 1;
+        }
+        else if (steps > total_steps - step)
+            steps = total_steps - step;
+        for (uint32_t i = 0; i < steps; ++i) // the engine still has to see the slept through steps
+            midi_sequencer_advance_locked(&controller, 1);
+        step += steps;
+        MIDI_Command command;
+        while (midi_commands_poll(&controller, &command))
+            ;
+    }
+    midi_controller_destrory(&controller);
+    return best / (SCHEDULER_BARS * SCHEDULER_BAR_STEPS);
+}
+
+int main(void)
+{
+    for (uint32_t size = 0; size < SCHEDULER_TRACK_SIZES; ++size)
+    {
+        const uint32_t tracks = scheduler_track_counts[size];
+        char path[] = "/tmp/midi_bench_scheduler_XXXXXX";
+        if (midi_bench_write_tracks(path, tracks) != 0)
+            continue;
+        uint32_t scan_wakes, heap_wakes;
+        const double scan = scheduler_run(path, MIDI_SCHEDULER_SCAN, &scan_wakes);
+        const double heap = scheduler_run(path, MIDI_SCHEDULER_HEAP, &heap_wakes);
+        printf("%4u tracks at %u PPQN: ns per step scan %.1f, heap %.1f. Clock wakes in %u bars scan %u, heap %u\n",
+               tracks, SCHEDULER_PPQN, scan, heap, SCHEDULER_BARS, scan_wakes, heap_wakes);
+        unlink(path);
+    }
+    return 0;
+}
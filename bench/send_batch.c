@@ -0,0 +1,55 @@
+/* A 20 note chord sent to /dev/null as single messages and as one batch. Singles take the lock and write once per
+ * message, the batch once per chord */
+#include "midi_bench.h"
+
+#define BATCH_NOTES 20
+#define BATCH_CHORDS 1000 // sent between queue drains
+#define BATCH_ROUNDS 100
+
+static double batch_run(MIDI_Controller* controller, const int batched)
+{
+    MIDI_Command chord[BATCH_NOTES];
+    for (uint32_t i = 0; i < BATCH_NOTES; ++i)
+        chord[i] = (MIDI_Command){MIDI_NOTE_ON, 40 + i, 100};
+    double best = 1e30;
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        double total = 0;
+        for (uint32_t round = 0; round < BATCH_ROUNDS; ++round)
+        {
+            const double start = midi_bench_ns();
+            for (uint32_t c = 0; c < BATCH_CHORDS; ++c)
+            {
+                if (batched)
+                    midi_message_send_batch(controller, chord, BATCH_NOTES);
+                else
+                {
+                    for (uint32_t i = 0; i < BATCH_NOTES; ++i)
+                        midi_message_send(controller, chord[i].command_byte, chord[i].param1, chord[i].param2);
+                }
+            }
+            total += midi_bench_ns() - start;
+            MIDI_Command command;
+            while (midi_commands_poll(controller, &command))
+                ;
+        }
+        const double per_message = total / ((double)BATCH_ROUNDS * BATCH_CHORDS * BATCH_NOTES);
+        if (per_message < best)
+            best = per_message;
+    }
+    return best;
+}
+
+int main(void)
+{
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.command_capacity = BATCH_CHORDS * BATCH_NOTES;
+    if (midi_controller_set_config(&controller, NULL, "/dev/null", EXTERNAL_INPUT_INACTIVE, &config) != MIDI_SETUP_SUCCESS)
+        return 1;
+    const double single = batch_run(&controller, 0);
+    const double batch = batch_run(&controller, 1);
+    printf("%u note chord to /dev/null, ns per message: single %.1f, batch %.1f\n", BATCH_NOTES, single, batch);
+    midi_controller_destrory(&controller);
+    return 0;
+}
@@ -0,0 +1,101 @@
+/* Generates a 50 MB type 1 Standard MIDI File, a tempo track and 64 tracks of running status notes (16.7M events), and
+ * times loading it at 960 PPQN */
+#include "midi_bench.h"
+
+#define SMF_BYTES 50000000u
+#define SMF_TRACKS 64
+#define SMF_DIVISION 960
+#define SMF_PPQN 960
+
+static uint32_t smf_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void smf_write_u32(FILE* file, const uint32_t value)
+{
+    const uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+    fwrite(bytes, 1, 4, file);
+}
+
+static void smf_write_u16(FILE* file, const uint16_t value)
+{
+    const uint8_t bytes[2] = {value >> 8, value};
+    fwrite(bytes, 1, 2, file);
+}
+
+/* The notes have delta times under 128 so each is one byte. The tempo changes are far apart and take three */
+static int smf_write(char* path)
+{
+    FILE* file = midi_bench_temp_file(path);
+    if (file == NULL)
+        return -1;
+    fwrite("MThd", 1, 4, file);
+    smf_write_u32(file, 6);
+    smf_write_u16(file, 1);
+    smf_write_u16(file, SMF_TRACKS + 1);
+    smf_write_u16(file, SMF_DIVISION);
+
+    // tempo track, a change every 16 bars
+    fwrite("MTrk", 1, 4, file);
+    smf_write_u32(file, 64 * 9 + 4);
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        const uint32_t delta = i == 0 ? 0 : SMF_DIVISION * 64, tempo = 400000 + i * 1000;
+        const uint8_t event[9] = {0x80 | (delta >> 14), 0x80 | ((delta >> 7) & 0x7F), delta & 0x7F, 0xFF, 0x51, 0x03,
+                                  tempo >> 16, (tempo >> 8) & 0xFF, tempo & 0xFF};
+        fwrite(event, 1, 9, file);
+    }
+    fwrite("\x00\xFF\x2F\x00", 1, 4, file);
+
+    uint32_t state = 0x9E3779B9u;
+    const uint32_t events = (SMF_BYTES / SMF_TRACKS - 8) / 3;
+    for (uint32_t t = 0; t < SMF_TRACKS; ++t)
+    {
+        fwrite("MTrk", 1, 4, file);
+        smf_write_u32(file, 4 + (events - 1) * 3 + 4);
+        const uint8_t first[4] = {0x00, 0x90 | (t % 16), 60, 100};
+        fwrite(first, 1, 4, file);
+        for (uint32_t e = 1; e < events; ++e)
+        {
+            const uint32_t random = smf_random(&state);
+            const uint8_t event[3] = {random % 31, (random >> 8) & 0x7F, (random >> 16) & 0x7F};
+            fwrite(event, 1, 3, file);
+        }
+        fwrite("\x00\xFF\x2F\x00", 1, 4, file);
+    }
+    return fclose(file);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/midi_bench_smf_XXXXXX";
+    if (smf_write(path) != 0)
+        return 1;
+    double best = 1e30;
+    uint32_t events = 0;
+    for (uint32_t run = 0; run < 3; ++run)
+    {
+        MIDI_Controller controller;
+        MIDI_Controller_Config config = {0};
+        config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+        config.ppqn = SMF_PPQN;
+        const double start = midi_bench_ns();
+        if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+            break;
+        const double load = midi_bench_ns() - start;
+        if (load < best)
+            best = load;
+        events = controller.midi_commands.pattern.event_count;
+        midi_controller_destrory(&controller);
+    }
+    struct stat file_stat;
+    stat(path, &file_stat);
+    printf("%.1f MB type 1 file, %u tracks, %u events at %u PPQN: loaded in %.0f ms, %.1f ns per event\n",
+           file_stat.st_size / 1e6, SMF_TRACKS, events, SMF_PPQN, best / 1e6, best / (events ? events : 1));
+    unlink(path);
+    return 0;
+}
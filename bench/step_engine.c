@@ -0,0 +1,79 @@
+/* 16, 256 and 4096 tracks of 1 to 4 bar loops with a note on and off per bar each, on every step engine the CPU runs.
+ * Prints the cost of one step of every track, launches included, clocked with the inline engine and with the sequencer
+ * stepped on its own. Build it without -march flags, the engines are picked at runtime */
+#include "midi_bench.h"
+
+#define STEP_BARS 200
+#define STEP_BAR_STEPS (MIDI_DEFAULT_PPQN * 4) // timed a bar at a time, the queue is drained in between
+
+static const uint32_t step_track_counts[] = {16, 256, 4096};
+#define STEP_TRACK_SIZES (sizeof(step_track_counts) / sizeof(step_track_counts[0]))
+static const char* step_isa_names[] = {"auto", "scalar", "SSE2", "AVX2", "AVX-512"};
+
+/* Best ns per step, clocked and alone. Returns -1 if the CPU can't run the engine */
+static int step_run(const char* path, const MIDI_Step_Engine_ISA isa, double best[2])
+{
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.command_capacity = 1 << 16;
+    config.step_engine_isa = isa;
+    if (midi_controller_set_config(&controller, path, NULL, 0, &config) != MIDI_SETUP_SUCCESS)
+        return -1;
+    if (midi_step_engine_isa(&controller) != isa) // fell back
+    {
+        midi_controller_destrory(&controller);
+        return -1;
+    }
+    best[0] = best[1] = 1e30;
+    for (uint32_t run = 0; run < MIDI_BENCH_RUNS; ++run)
+    {
+        for (uint32_t alone = 0; alone < 2; ++alone)
+        {
+            double total = 0;
+            for (uint32_t bar = 0; bar < STEP_BARS; ++bar)
+            {
+                const double start = midi_bench_ns();
+                for (uint32_t step = 0; step < STEP_BAR_STEPS; ++step)
+                {
+                    if (alone) // no other thread runs, so the lock the clock takes isn't needed
+                        midi_sequencer_advance_locked(&controller, 1);
+                    else
+                        midi_command_clock(&controller);
+                }
+                total += midi_bench_ns() - start;
+                MIDI_Command command;
+                while (midi_commands_poll(&controller, &command))
+                    ;
+            }
+            if (total < best[alone])
+                best[alone] = total;
+        }
+    }
+    midi_controller_destrory(&controller);
+    best[0] /= STEP_BARS * STEP_BAR_STEPS;
+    best[1] /= STEP_BARS * STEP_BAR_STEPS;
+    return 0;
+}
+
+int main(void)
+{
+    for (uint32_t size = 0; size < STEP_TRACK_SIZES; ++size)
+    {
+        const uint32_t tracks = step_track_counts[size];
+        char path[] = "/tmp/midi_bench_steps_XXXXXX";
+        if (midi_bench_write_tracks(path, tracks) != 0)
+            continue;
+        for (MIDI_Step_Engine_ISA isa = MIDI_STEP_ENGINE_SCALAR; isa <= MIDI_STEP_ENGINE_AVX512; ++isa)
+        {
+            double ns[2];
+            if (step_run(path, isa, ns) != 0)
+                printf("%4u tracks, %-7s: not supported by this CPU\n", tracks, step_isa_names[isa]);
+            else
+                printf("%4u tracks, %-7s: %.1f ns per clocked step, %.1f ns per sequencer step (%.2f per track)\n", tracks,
+                       step_isa_names[isa], ns[0], ns[1], ns[1] / tracks);
+        }
+        unlink(path);
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* Master clock at 240 bpm playing a note on every 6th tick out to a pty. The time from each 0xF8 to the note on that
+ * follows it arriving on the master side, with the midi thread and with the inline tick engine */
+#include "midi_bench.h"
+#include <termios.h>
+
+#define LATENCY_BPM 240.0f
+#define LATENCY_SECONDS 10
+#define LATENCY_MAX_SAMPLES 1024
+
+typedef struct
+{
+    int master;
+    volatile int running;
+    double samples[LATENCY_MAX_SAMPLES]; // us from the clock byte to the note on
+    uint32_t count;
+} Latency_Reader;
+
+static void* latency_read(void* arg)
+{
+    Latency_Reader* reader = (Latency_Reader*)arg;
+    double clock_ns = 0;
+    uint8_t buffer[256];
+    while (reader->running)
+    {
+        struct pollfd fds = {reader->master, POLLIN, 0};
+        if (poll(&fds, 1, 100) <= 0)
+            continue;
+        const ssize_t bytes = read(reader->master, buffer, sizeof(buffer));
+        const double now = midi_bench_ns();
+        for (ssize_t i = 0; i < bytes; ++i)
+        {
+            if (buffer[i] == (MIDI_SYSTEM_MESSAGE | MIDI_CLOCK))
+                clock_ns = now;
+            else if (buffer[i] == MIDI_NOTE_ON && clock_ns != 0 && reader->count < LATENCY_MAX_SAMPLES)
+            {
+                reader->samples[reader->count++] = (now - clock_ns) / 1e3;
+                clock_ns = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int latency_compare(const void* a, const void* b)
+{
+    const double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void latency_run(const char* pattern, const char* device, const int master, const MIDI_Tick_Engine engine, const char* name)
+{
+    static Latency_Reader reader;
+    reader.master = master;
+    reader.running = 1;
+    reader.count = 0;
+    tcflush(master, TCIFLUSH);
+    pthread_t thread;
+    pthread_create(&thread, NULL, latency_read, &reader);
+
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = engine;
+    if (midi_controller_set_config(&controller, pattern, device, EXTERNAL_INPUT_INACTIVE, &config) == MIDI_SETUP_SUCCESS)
+    {
+        midi_clock_set(&controller, LATENCY_BPM);
+        sleep(LATENCY_SECONDS);
+        midi_controller_destrory(&controller);
+    }
+    reader.running = 0;
+    pthread_join(thread, NULL);
+
+    if (reader.count == 0)
+    {
+        printf("%s engine: no notes received\n", name);
+        return;
+    }
+    qsort(reader.samples, reader.count, sizeof(double), latency_compare);
+    printf("%s engine: %u notes, clock to note on median %.1f us, p99 %.1f us\n", name, reader.count,
+           reader.samples[reader.count / 2], reader.samples[reader.count * 99 / 100]);
+}
+
+int main(void)
+{
+    char pattern[] = "/tmp/midi_bench_latency_XXXXXX";
+    FILE* file = midi_bench_temp_file(pattern);
+    if (file == NULL)
+        return 1;
+    fprintf(file, "{\nCHANNEL: 1\nloop_bars: 1\n");
+    for (uint32_t sixteenth = 0; sixteenth < 16; ++sixteenth)
+        fprintf(file, "#(90,3C,64,%g) ", 1 + sixteenth * 0.25);
+    fprintf(file, "\n}\n");
+    fclose(file);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+        return 1;
+    const char* device = ptsname(master);
+    struct termios raw;
+    int slave = open(device, O_RDWR | O_NOCTTY); // kept open so the master never sees a hangup between runs
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+
+    latency_run(pattern, device, master, MIDI_TICK_ENGINE_THREAD, "thread");
+    latency_run(pattern, device, master, MIDI_TICK_ENGINE_INLINE, "inline");
+    close(slave);
+    close(master);
+    unlink(pattern);
+    return 0;
+}
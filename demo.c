@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // before any system header, the MIDI interface uses thread affinity
 #define MINIAUDIO_IMPLEMENTATION
 #include "demo/miniaudio.h"
 #define MIDI_INTERFACE_IMPLEMENTATION
@@ -248,27 +249,21 @@ void note_off(Sound_Controller* sc, uint8_t channel, uint8_t key, uint8_t veloci
 
 void process_midi_commands(Sound_Controller* sc)
 {
-    if (sc->midi_controller->command_count == 0)
-        return;
-
-    pthread_mutex_lock(&sc->midi_controller->mutex);
-
-
-    for(uint8_t i = sc->midi_controller->commands_processed; i < sc->midi_controller->command_count; ++i)
+    static MIDI_Transport transport = MIDI_TRANSPORT_STOPPED;
+    if (midi_transport_state(sc->midi_controller) != transport)
     {
-        MIDI_Command command = sc->midi_controller->commands[i];
+        transport = midi_transport_state(sc->midi_controller);
+        printf(transport == MIDI_TRANSPORT_PLAYING ? "MIDI START\n" : "MIDI STOP\n");
+    }
 
+    MIDI_Command command;
+    while (midi_commands_poll(sc->midi_controller, &command))
+    {
         uint8_t command_nibble = 0;
         uint8_t channel = 0;
         midi_command_byte_parse(command.command_byte, &command_nibble, &channel);
         switch(command_nibble)
         {
-        case MIDI_SYSTEM_MESSAGE:
-            if (command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_CLOCK))
-                ;
-            else if (command.command_byte == (MIDI_SYSTEM_MESSAGE | MIDI_START))
-                printf("MIDI START\n");
-            break;
         case MIDI_NOTE_OFF:
             note_off(sc, channel, command.param1, command.param2);
             break;
@@ -282,9 +277,7 @@ void process_midi_commands(Sound_Controller* sc)
         case MIDI_PITCH_BEND:
             break;
         }
-        ++sc->midi_controller->commands_processed;
     }
-    pthread_mutex_unlock(&sc->midi_controller->mutex);
 
     return;
 }
@@ -675,7 +668,6 @@ void data_callback_f32(ma_device* pDevice, void* pOutput, const void* pInput, ma
         {
             if (s->midi_clock)
                 midi_command_clock(s->midiController);
-            //printf("clock and command count: %u\n", s->midiController->command_count);
         }
         ++s->globalCursor;
         if (s->globalCursor > s->loopFrameLength)
@@ -0,0 +1,148 @@
+/* 16-note chords on all 16 channels at once, notes 48 - 63 on at beat 1 and off at beat 3 of a 1 bar loop.
+ * Every event due on a tick has to go out on it, or spill onto the next ticks when the burst limit is lower */
+#include "midi_test.h"
+
+#define CHORDS_FILE "tests/chords16.midi"
+#define CHORDS_NOTES 16
+#define CHORDS_FIRST_NOTE 48
+#define CHORDS_LOOPS 2
+#define CHORDS_BAR_STEPS (MIDI_DEFAULT_PPQN * 4)
+#define CHORDS_OFF_STEP (MIDI_DEFAULT_PPQN * 2)
+
+typedef struct
+{
+    uint32_t on[CHORDS_BAR_STEPS * CHORDS_LOOPS];
+    uint32_t off[CHORDS_BAR_STEPS * CHORDS_LOOPS];
+    uint16_t notes_on[MIDI_MAX_CHANNELS][CHORDS_LOOPS]; // bit per chord note seen
+    uint16_t notes_off[MIDI_MAX_CHANNELS][CHORDS_LOOPS];
+} Chords_Run;
+
+/* Clocks the chords through CHORDS_LOOPS bars, step is the clock call the event was polled after */
+static void chords_run(const MIDI_Step_Scheduler scheduler, const uint32_t burst_limit, Chords_Run* run)
+{
+    memset(run, 0, sizeof(Chords_Run));
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.scheduler = scheduler;
+    config.burst_limit = burst_limit;
+    config.command_capacity = 4096;
+    const int setup = midi_controller_set_config(&controller, CHORDS_FILE, NULL, 0, &config);
+    MIDI_TEST_CHECK(setup == MIDI_SETUP_SUCCESS, "setup failed");
+    if (setup != MIDI_SETUP_SUCCESS)
+        return;
+
+    for (uint32_t step = 0; step < CHORDS_BAR_STEPS * CHORDS_LOOPS; ++step)
+    {
+        midi_command_clock(&controller);
+        MIDI_Event event;
+        while (midi_events_poll(&controller, &event))
+        {
+            const uint8_t channel = event.command.command_byte & 0x0F;
+            const uint8_t note = event.command.param1 - CHORDS_FIRST_NOTE;
+            const uint32_t loop = step / CHORDS_BAR_STEPS;
+            MIDI_TEST_CHECK(note < CHORDS_NOTES, "note %u outside the chord", event.command.param1);
+            if (note >= CHORDS_NOTES)
+                continue;
+            if ((event.command.command_byte & 0xF0) == MIDI_NOTE_ON)
+            {
+                ++run->on[step];
+                run->notes_on[channel][loop] |= (uint16_t)(1u << note);
+            }
+            else
+            {
+                ++run->off[step];
+                run->notes_off[channel][loop] |= (uint16_t)(1u << note);
+            }
+        }
+    }
+    midi_controller_destrory(&controller);
+}
+
+/* spill_steps is how many steps each chord is spread over */
+static void chords_check(const MIDI_Step_Scheduler scheduler, const uint32_t burst_limit, const uint32_t spill_steps)
+{
+    static Chords_Run run;
+    chords_run(scheduler, burst_limit, &run);
+    const uint32_t per_step = MIDI_MAX_CHANNELS * CHORDS_NOTES / spill_steps;
+    for (uint32_t step = 0; step < CHORDS_BAR_STEPS * CHORDS_LOOPS; ++step)
+    {
+        const uint32_t in_bar = step % CHORDS_BAR_STEPS;
+        const uint32_t expected_on = in_bar < spill_steps ? per_step : 0;
+        const uint32_t expected_off = in_bar >= CHORDS_OFF_STEP && in_bar < CHORDS_OFF_STEP + spill_steps ? per_step : 0;
+        MIDI_TEST_CHECK(run.on[step] == expected_on, "scheduler %d burst %u step %u: %u note ons, expected %u",
+                        scheduler, burst_limit, step, run.on[step], expected_on);
+        MIDI_TEST_CHECK(run.off[step] == expected_off, "scheduler %d burst %u step %u: %u note offs, expected %u",
+                        scheduler, burst_limit, step, run.off[step], expected_off);
+    }
+    for (uint32_t channel = 0; channel < MIDI_MAX_CHANNELS; ++channel)
+    {
+        for (uint32_t loop = 0; loop < CHORDS_LOOPS; ++loop)
+        {
+            MIDI_TEST_CHECK(run.notes_on[channel][loop] == UINT16_MAX && run.notes_off[channel][loop] == UINT16_MAX,
+                            "scheduler %d burst %u channel %u loop %u: chord notes on %04x off %04x",
+                            scheduler, burst_limit, channel + 1, loop, run.notes_on[channel][loop], run.notes_off[channel][loop]);
+        }
+    }
+}
+
+/* tests/spill.midi, burst limit 4. Channel 1 has an 8 note chord on step 0 and a note on step 1, the note falls due
+ * while the chord spills and has to follow it on step 2. Channel 2 has a note on step 0 and the chord on the last step,
+ * so the spill runs into the next loop and the note follows it on step 1. Both have to play on every loop */
+#define SPILL_FILE "tests/spill.midi"
+#define SPILL_LOOPS 4
+#define SPILL_NOTE 0x3C
+
+static void spill_check(const MIDI_Step_Scheduler scheduler)
+{
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.scheduler = scheduler;
+    config.burst_limit = 4;
+    const int setup = midi_controller_set_config(&controller, SPILL_FILE, NULL, 0, &config);
+    MIDI_TEST_CHECK(setup == MIDI_SETUP_SUCCESS, "setup failed");
+    if (setup != MIDI_SETUP_SUCCESS)
+        return;
+
+    for (uint32_t step = 0; step < CHORDS_BAR_STEPS * SPILL_LOOPS; ++step)
+    {
+        uint32_t chord[2] = {0}, note[2] = {0};
+        midi_command_clock(&controller);
+        MIDI_Event event;
+        while (midi_events_poll(&controller, &event))
+        {
+            const uint8_t channel = event.command.command_byte & 0x0F;
+            if (channel > 1)
+                continue;
+            if (event.command.param1 == SPILL_NOTE)
+                ++note[channel];
+            else
+                ++chord[channel];
+        }
+        const uint32_t loop = step / CHORDS_BAR_STEPS, in_bar = step % CHORDS_BAR_STEPS;
+        const uint32_t last = CHORDS_BAR_STEPS - 1;
+        const uint32_t expected_chord[2] = {in_bar < 2 ? 4 : 0, in_bar == last || (in_bar == 0 && loop > 0) ? 4 : 0};
+        const uint32_t expected_note[2] = {in_bar == 2, loop > 0 ? in_bar == 1 : in_bar == 0};
+        for (uint32_t channel = 0; channel < 2; ++channel)
+        {
+            MIDI_TEST_CHECK(chord[channel] == expected_chord[channel] && note[channel] == expected_note[channel],
+                            "spill scheduler %d channel %u loop %u step %u: %u chord notes and %u notes, expected %u and %u",
+                            scheduler, channel + 1, loop, in_bar, chord[channel], note[channel], expected_chord[channel], expected_note[channel]);
+        }
+    }
+    midi_controller_destrory(&controller);
+}
+
+int main(void)
+{
+    const MIDI_Step_Scheduler schedulers[] = {MIDI_SCHEDULER_SCAN, MIDI_SCHEDULER_HEAP};
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+        chords_check(schedulers[i], 0, 1);  // default burst limit, every chord on its own step
+        chords_check(schedulers[i], 16, 1); // exactly one chord per track per step
+        chords_check(schedulers[i], 4, 4);  // 4 notes per track per step, each chord spills over 4 steps
+        spill_check(schedulers[i]);
+    }
+    return midi_test_result("chords");
+}
@@ -0,0 +1,60 @@
+/* Creates and destroys 10,000 controllers with every thread running. Destroy joins the threads instead of sleeping,
+ * so each cycle has to finish in well under the second the old teardown slept for */
+#define _GNU_SOURCE
+#include "midi_test.h"
+#include <termios.h>
+
+#define LIFECYCLE_CYCLES 10000
+#define LIFECYCLE_MAX_CYCLE_MS 100.0
+
+static void* lifecycle_drain(void* arg)
+{
+    const int master = *(int*)arg;
+    uint8_t buffer[256];
+    while (read(master, buffer, sizeof(buffer)) > 0)
+        ;
+    return NULL;
+}
+
+int main(void)
+{
+    // a pty stands in for the external device, so the input thread runs too
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    MIDI_TEST_CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0, "pty setup failed");
+    if (master < 0)
+        return midi_test_result("controller_lifecycle");
+    const char* device = ptsname(master);
+    struct termios raw;
+    int slave = open(device, O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+    pthread_t drain;
+    pthread_create(&drain, NULL, lifecycle_drain, &master);
+
+    double slowest = 0;
+    const double start = midi_test_ms();
+    for (uint32_t i = 0; i < LIFECYCLE_CYCLES && midi_test_failures == 0; ++i)
+    {
+        const double cycle_start = midi_test_ms();
+        MIDI_Controller controller;
+        const int setup = midi_controller_set(&controller, "demo/demo1.midi", device, 0);
+        MIDI_TEST_CHECK(setup == MIDI_SETUP_SUCCESS, "cycle %u setup failed", i);
+        if (setup != MIDI_SETUP_SUCCESS)
+            break;
+        midi_clock_set(&controller, 240);
+        midi_note_on(&controller, MIDI_CHANNEL_1, 440.0f, 100);
+        midi_controller_destrory(&controller);
+        const double cycle = midi_test_ms() - cycle_start;
+        if (cycle > slowest)
+            slowest = cycle;
+    }
+    const double total = midi_test_ms() - start;
+    MIDI_TEST_CHECK(slowest < LIFECYCLE_MAX_CYCLE_MS, "slowest set/destroy cycle took %.1f ms", slowest);
+    printf("%u cycles in %.0f ms, slowest %.2f ms\n", LIFECYCLE_CYCLES, total, slowest);
+
+    close(slave); // the drain's read gets EIO once the last slave is closed
+    pthread_join(drain, NULL);
+    close(master);
+    return midi_test_result("controller_lifecycle");
+}
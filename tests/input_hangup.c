@@ -0,0 +1,62 @@
+/* The external device goes away under a running controller. The input thread has to notice and stop instead of
+ * spinning on a read that keeps failing, and destroy still has to work afterwards */
+#define _GNU_SOURCE
+#include "midi_test.h"
+#include <termios.h>
+
+#define HANGUP_WAIT_MS 300
+#define HANGUP_MAX_CPU_MS 30.0
+
+static double hangup_cpu_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+int main(void)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    MIDI_TEST_CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0, "pty setup failed");
+    if (master < 0)
+        return midi_test_result("input_hangup");
+    const char* device = ptsname(master);
+    struct termios raw;
+    int slave = open(device, O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+    close(slave);
+
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE; // only the input thread runs
+    const int setup = midi_controller_set_config(&controller, NULL, device, EXTERNAL_INPUT_THROUGH, &config);
+    MIDI_TEST_CHECK(setup == MIDI_SETUP_SUCCESS, "setup failed");
+    if (setup != MIDI_SETUP_SUCCESS)
+        return midi_test_result("input_hangup");
+
+    // a note through first, so the thread is known to be reading
+    const uint8_t note_on[3] = {0x90, 60, 100};
+    write(master, note_on, sizeof(note_on));
+    MIDI_Event event;
+    uint32_t received = 0;
+    for (uint32_t i = 0; i < 100 && received == 0; ++i)
+    {
+        usleep(1000);
+        while (midi_events_poll(&controller, &event))
+            received += event.command.command_byte == 0x90 && event.command.param1 == 60;
+    }
+    MIDI_TEST_CHECK(received == 1, "note through the pty wasn't received");
+
+    close(master);
+    usleep(50000); // the thread sees the hangup
+    const double cpu_start = hangup_cpu_ms();
+    usleep(HANGUP_WAIT_MS * 1000);
+    const double cpu = hangup_cpu_ms() - cpu_start;
+    MIDI_TEST_CHECK(cpu < HANGUP_MAX_CPU_MS, "%.0f ms of cpu used in %u ms after the hangup", cpu, HANGUP_WAIT_MS);
+    printf("%.1f ms of cpu in the %u ms after the hangup\n", cpu, HANGUP_WAIT_MS);
+
+    midi_controller_destrory(&controller);
+    return midi_test_result("input_hangup");
+}
@@ -0,0 +1,33 @@
+/* Shared by the tests. Each test is one file built against the header and run from the repo root, see the README */
+#pragma once
+#define MIDI_INTERFACE_IMPLEMENTATION
+#include "../MIDI_interface.h"
+
+static uint32_t midi_test_failures = 0;
+
+#define MIDI_TEST_CHECK(condition, ...)                                                  \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(condition))                                                                \
+        {                                                                                \
+            printf(MIDI_COLOR_RED "FAIL %s:%d - " MIDI_COLOR_RESET, __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                                                         \
+            printf("\n");                                                                \
+            ++midi_test_failures;                                                        \
+        }                                                                                \
+    } while (0)
+
+MIDI_INLINE double midi_test_ms(void)
+{
+    return midi_time_now_ns() / 1e6;
+}
+
+/* Prints the verdict, the return value is the exit code */
+MIDI_INLINE int midi_test_result(const char* name)
+{
+    if (midi_test_failures == 0)
+        printf("PASS %s\n", name);
+    else
+        printf(MIDI_COLOR_RED "FAIL %s, %u checks failed\n" MIDI_COLOR_RESET, name, midi_test_failures);
+    return midi_test_failures != 0;
+}
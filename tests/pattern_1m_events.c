@@ -0,0 +1,124 @@
+/* Loads a single track of 1M events, in order and shuffled, and checks every one goes out on its step.
+ * Building the track used to be quadratic and was capped at 65535 events */
+#include "midi_test.h"
+
+#define STRESS_PAIRS 500000  // an ON and an OFF per beat
+#define STRESS_MAX_LOAD_MS 5000.0
+#define STRESS_SHUFFLE_SEED 0x9E3779B9u
+
+static const uint8_t stress_notes[] = {48, 52, 55, 60, 64};
+#define STRESS_NOTE_COUNT (sizeof(stress_notes) / sizeof(stress_notes[0]))
+
+static uint32_t stress_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* ON of pair k on beat k + 1, its OFF half a beat later, all on one line so they are one track */
+static int stress_write_pattern(char* path, const int shuffled)
+{
+    uint32_t* order = malloc(STRESS_PAIRS * sizeof(uint32_t));
+    const int fd = mkstemp(path);
+    FILE* file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (order == NULL || file == NULL)
+    {
+        free(order);
+        return -1;
+    }
+    for (uint32_t k = 0; k < STRESS_PAIRS; ++k)
+        order[k] = k;
+    uint32_t state = STRESS_SHUFFLE_SEED;
+    for (uint32_t k = STRESS_PAIRS - 1; shuffled && k > 0; --k)
+    {
+        const uint32_t other = stress_random(&state) % (k + 1);
+        const uint32_t swap = order[k];
+        order[k] = order[other];
+        order[other] = swap;
+    }
+
+    fprintf(file, "{\nCHANNEL: 1\nloop_bars: %u\n", STRESS_PAIRS / 4 + 1);
+    for (uint32_t i = 0; i < STRESS_PAIRS; ++i)
+    {
+        const uint32_t k = order[i];
+        // rounded up, the note conversion truncates
+        const double frequency = ceil(midi_note_to_frequence(stress_notes[k % STRESS_NOTE_COUNT]) * 100.0) / 100.0;
+        fprintf(file, "ON(%.2f,%u,%u) OFF(%.2f,0,%u.5) ", frequency, k % 127 + 1, k + 1, frequency, k + 1);
+    }
+    fprintf(file, "\n}\n");
+    free(order);
+    return fclose(file);
+}
+
+static void stress_check(const char* path, const char* name, const MIDI_Step_Scheduler scheduler)
+{
+    MIDI_Controller controller;
+    MIDI_Controller_Config config = {0};
+    config.tick_engine = MIDI_TICK_ENGINE_INLINE;
+    config.scheduler = scheduler;
+    const double start = midi_test_ms();
+    const int setup = midi_controller_set_config(&controller, path, NULL, 0, &config);
+    const double load = midi_test_ms() - start;
+    MIDI_TEST_CHECK(setup == MIDI_SETUP_SUCCESS, "%s setup failed", name);
+    if (setup != MIDI_SETUP_SUCCESS)
+        return;
+    MIDI_TEST_CHECK(controller.midi_commands.pattern.event_count == 2 * STRESS_PAIRS, "%s compiled %u events", name,
+                    controller.midi_commands.pattern.event_count);
+    MIDI_TEST_CHECK(load < STRESS_MAX_LOAD_MS, "%s took %.0f ms to load", name, load);
+
+    const uint32_t steps_per_beat = MIDI_DEFAULT_PPQN;
+    const uint32_t loop_steps = (STRESS_PAIRS / 4 + 1) * 4 * steps_per_beat;
+    uint32_t ons = 0, offs = 0, wrong = 0;
+    for (uint32_t step = 0; step < loop_steps && wrong < 10; ++step)
+    {
+        midi_command_clock(&controller);
+        MIDI_Event event;
+        while (midi_events_poll(&controller, &event))
+        {
+            const MIDI_Command command = event.command;
+            if ((command.command_byte & 0xF0) == MIDI_NOTE_ON)
+            {
+                const uint32_t k = ons++;
+                if (step != k * steps_per_beat || command.param1 != stress_notes[k % STRESS_NOTE_COUNT] || command.param2 != k % 127 + 1)
+                {
+                    MIDI_TEST_CHECK(0, "%s ON %u came out on step %u as %02x %02x %02x", name, k, step,
+                                    command.command_byte, command.param1, command.param2);
+                    ++wrong;
+                }
+            }
+            else
+            {
+                const uint32_t k = offs++;
+                if (step != k * steps_per_beat + steps_per_beat / 2 || command.param1 != stress_notes[k % STRESS_NOTE_COUNT])
+                {
+                    MIDI_TEST_CHECK(0, "%s OFF %u came out on step %u as %02x %02x %02x", name, k, step,
+                                    command.command_byte, command.param1, command.param2);
+                    ++wrong;
+                }
+            }
+        }
+    }
+    MIDI_TEST_CHECK(ons == STRESS_PAIRS && offs == STRESS_PAIRS, "%s played %u ons and %u offs", name, ons, offs);
+    printf("%s, scheduler %d: loaded in %.0f ms, %u steps played in %.0f ms\n", name, scheduler, load, loop_steps,
+           midi_test_ms() - start - load);
+    midi_controller_destrory(&controller);
+}
+
+int main(void)
+{
+    const char* names[] = {"in order", "shuffled"};
+    for (int shuffled = 0; shuffled < 2; ++shuffled)
+    {
+        char path[] = "/tmp/midi_1m_events_XXXXXX";
+        const int written = stress_write_pattern(path, shuffled);
+        MIDI_TEST_CHECK(written == 0, "couldn't write %s", path);
+        if (written != 0)
+            continue;
+        stress_check(path, names[shuffled], MIDI_SCHEDULER_SCAN);
+        stress_check(path, names[shuffled], MIDI_SCHEDULER_HEAP);
+        unlink(path);
+    }
+    return midi_test_result("pattern_1m_events");
+}